@@ -56,6 +56,9 @@ typedef struct Ast_t {
     int capacity;
     Token *assoc_token;
     const Ang_Type *eval_type;
+    int known_int; // Num computed only from integers
+    int tail; // Its value is what the enclosing lambda returns
+    int discarded; // Its value is thrown away so it needn't be pushed
 } Ast;
 
 const char *ast_type_to_str(Ast_Type t);
@@ -0,0 +1,150 @@
+#ifndef ANG_CODE_H
+#define ANG_CODE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "list.h"
+#include "ang_opcodes.h"
+#include "ang_type.h"
+
+/* Threaded dispatch relies on the labels as values extension. Define
+ * ANG_NO_THREADING to fall back to the portable switch loop.
+ */
+#if defined(__GNUC__) && !defined(ANG_NO_THREADING)
+#define ANG_THREADED 1
+#endif
+
+#define OPERAND_KINDS(code) \
+    code(UINT) \
+    code(INT) \
+    code(CONST) \
+    code(ADDR) \
+    code(CACHE)
+
+#define DEFINE_ENUM_TYPE(type) OPERAND_##type,
+typedef enum {
+    OPERAND_KINDS(DEFINE_ENUM_TYPE)
+} Operand_Kind;
+#undef DEFINE_ENUM_TYPE
+
+#define CACHE_ENTRIES 4
+
+/** Remembers the outcome of a type test at one site
+ * Entries fill up from the first, so a site that only ever sees one type
+ * hits on the first compare. Once full, further types are tested uncached.
+ */
+typedef struct {
+    const Ang_Type *types[CACHE_ENTRIES];
+    uint8_t results[CACHE_ENTRIES];
+    uint8_t length;
+} Inline_Cache;
+
+/** Most values a frame holds above where it starts, as found by verify_code
+ * Lambda frames start at their frame pointer and top level code at the stack
+ * pointer it is entered with.
+ */
+typedef struct {
+    size_t entry;
+    int depth;
+} Frame_Depth;
+
+/** Packed form of the compiled instructions
+ * Opcodes take a single byte. Integer operands, code addresses and constant
+ * pool indices follow as LEB128 varints. Anything that is not a small
+ * integer (types, strings, doubles, ...) lives in the constant pool.
+ */
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+
+    Value *consts;
+    size_t num_consts;
+    size_t consts_capacity;
+    uint32_t *const_index;
+    size_t index_capacity;
+
+    Inline_Cache *caches;
+    size_t num_caches;
+
+    Frame_Depth *frame_depths; // Sorted by entry
+    size_t num_frame_depths;
+    size_t verified; // Length of the code verify_code has accepted
+
+    size_t loaded;
+} Code;
+
+void ctor_code(Code *code);
+void dtor_code(Code *code);
+
+Operand_Kind operand_kind(Opcode op, int operand);
+
+/** Encodes the instructions of instr that have not been loaded yet
+ * Jumps are relocated from instruction indices to byte offsets. The code is
+ * always terminated by a HALT which is overwritten by the next load.
+ */
+void load_code(Code *code, const List *instr);
+
+/** Returns the index of the constant in the pool, adding it if needed
+ */
+uint32_t add_const(Code *code, Value v);
+
+/** Rewrites the varint of length bytes at at to n, padding it with
+ * continuation bytes so the code around it stays put
+ * Returns 0, leaving at untouched, if n needs more bytes than that.
+ */
+int patch_uint(uint8_t *at, size_t length, uint32_t n);
+
+/** Records the depth of the frame starting at entry
+ */
+void add_frame_depth(Code *code, size_t entry, int depth);
+
+/** Returns the depth of the frame starting at entry, or -1 if it is unknown
+ */
+int frame_depth(const Code *code, size_t entry);
+
+/** Returns a hash of the loaded bytes, to tell whether two loads match
+ */
+uint32_t code_checksum(const Code *code);
+
+/** Decodes the operand at *offset and advances past it
+ * Integers and addresses are returned as numbers and constants as the pooled
+ * value.
+ */
+Value read_operand(const Code *code, Operand_Kind kind, size_t *offset);
+
+/** Returns the cached result of testing type, or -1 if it isn't cached
+ */
+static inline int lookup_cache(const Inline_Cache *cache, const Ang_Type *type) {
+    for (int i = 0; i < cache->length; i++) {
+        if (cache->types[i] == type) return cache->results[i];
+    }
+    return -1;
+}
+
+static inline void update_cache(Inline_Cache *cache, const Ang_Type *type, int result) {
+    if (cache->length == CACHE_ENTRIES) return;
+    cache->types[cache->length] = type;
+    cache->results[cache->length++] = result;
+}
+
+static inline uint32_t read_uint(const uint8_t **pc) {
+    uint32_t n = *(*pc)++;
+    if (n < 0x80) return n;
+    n &= 0x7f;
+    int shift = 7;
+    uint8_t b;
+    do {
+        b = *(*pc)++;
+        n |= (uint32_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return n;
+}
+
+static inline int32_t read_int(const uint8_t **pc) {
+    uint32_t n = read_uint(pc);
+    return (int32_t) (n >> 1) ^ -(int32_t) (n & 1);
+}
+
+#endif // ANG_CODE_H
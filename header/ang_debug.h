@@ -9,4 +9,7 @@
 
 void print_stack_trace(const Ang_VM *vm);
 
+// Prints the lambda calls in progress, innermost first
+void print_backtrace(const Ang_VM *vm);
+
 #endif // ANG_DEBUG_H
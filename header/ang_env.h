@@ -10,6 +10,7 @@ typedef struct {
     int mut;
     int assigned;
     int global;
+    int known_int;
 } Symbol;
 
 typedef struct {
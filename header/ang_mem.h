@@ -3,41 +3,270 @@
 
 #include "ang_obj.h"
 #include <stdlib.h>
+#include <stdint.h>
 
-#define MAX_STACK_SIZE 256
+// Stack sizes are in values
+#define DEFAULT_STACK_SIZE 1024
+#define DEFAULT_MAX_STACK_SIZE (1 << 20)
 #define MAX_LOCALS 256
+#define DEFAULT_FRAMES 64
+// Objects allocated between minor collections
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE 1024
+#endif
+/* Gray objects scanned after each minor collection while the old generation
+ * is being marked. A minor collection promotes at most NURSERY_SIZE objects,
+ * so marking keeps ahead of the old generation's growth.
+ */
+#ifndef MARK_SLICE
+#define MARK_SLICE (2 * NURSERY_SIZE)
+#endif
+// Old objects swept before each minor collection once marking has finished
+#ifndef SWEEP_SLICE
+#define SWEEP_SLICE (2 * NURSERY_SIZE)
+#endif
+// Allocations up to MAX_SLAB_ALLOC bytes are rounded up to a size class, a
+// multiple of SLAB_GRANULE, and cut from slabs of SLAB_BYTES
+#define SLAB_GRANULE 16
+#define SLAB_CLASSES 16
+#define MAX_SLAB_ALLOC (SLAB_GRANULE * SLAB_CLASSES)
+#define SLAB_BYTES (32 * 1024)
 
 typedef enum {
     A, B, C, D, RET_VAL, NUM_REGISTERS
 } Registers;
 
+/** A lambda call in progress
+ */
 typedef struct {
-    Value stack[MAX_STACK_SIZE];
+    int ip; // Where to return to
+    int fp; // Frame pointer of the caller
+    Ang_Obj *closure; // Lambda being run
+    int callee; // Entry ip of the lambda
+} Call_Frame;
+
+/** The stack is reserved at its maximum size up front but only the first
+ * stack_size values are accessible. Pushing past them faults on the protected
+ * pages, which grows the stack or, past max_stack_size, reports an overflow.
+ */
+typedef struct {
+    Value *stack;
+    size_t stack_size;
+    size_t max_stack_size;
+
+    Call_Frame *frames;
+    size_t num_frames;
+    size_t frames_capacity;
 
     size_t gmem_size;
     size_t global_size;
     Value *gmem;
 
+    /* Objects are bump allocated in the nursery. A minor collection copies
+     * the ones still reachable into the old generation, linked from mem_head,
+     * which is marked a slice at a time once it has grown past max_objects,
+     * then swept a slice at a time.
+     */
+    Ang_Obj *nursery;
+    size_t nursery_used;
     size_t num_objects;
     size_t max_objects;
     Ang_Obj *mem_head;
+    int marking; // Whether the old generation is being marked
+    Mark_Stack gray;
+    struct Mark_Pool *mark_pool; // Finishes the marking on several threads, if started
+    Ang_Obj **sweep; // Link to the next object to sweep, 0 if swept
+    struct Sweeper *sweeper; // Frees payloads in the background, if started
+    // Old objects given a reference to a nursery object since the last minor
+    Ang_Obj **remembered;
+    size_t num_remembered;
+    size_t remembered_capacity;
+    // Values outside of memory holding objects
+    Value **roots;
+    size_t num_roots;
+    size_t roots_capacity;
+    // Free blocks of each size class, and the slabs they were cut from
+    void *free_blocks[SLAB_CLASSES];
+    void *slabs;
     Value registers[NUM_REGISTERS];
 
     int ip, sp, fp;
 } Memory;
 
-void ctor_memory(Memory *mem, size_t gmem_size);
+void ctor_memory(Memory *mem,
+        size_t gmem_size,
+        size_t stack_size,
+        size_t max_stack_size);
 void dtor_memory(Memory *mem);
 
+/** Calls run(arg) with faults on mem's stack guard handled
+ * Returns 0 if the stack overflowed, in which case run was cut short.
+ */
+int run_stack_guarded(Memory *mem, void (*run)(void *), void *arg);
+
+/** Makes the first size values of the stack accessible up front
+ * Only valid inside run_stack_guarded, which is cut short if size is past the
+ * maximum.
+ */
+void grow_stack(Memory *mem, size_t size);
+
+// Cuts a new slab into blocks of size_class, returning one of them
+void *new_slab(Memory *mem, size_t size_class);
+
+/** Allocates size bytes that are freed with mem_free or along with mem
+ * Runtime objects and their payloads come from here.
+ */
+static inline void *mem_alloc(Memory *mem, size_t size) {
+    if (size > MAX_SLAB_ALLOC) return malloc(size);
+    size_t size_class = size ? (size - 1) / SLAB_GRANULE : 0;
+    void *block = mem->free_blocks[size_class];
+    if (!block) return new_slab(mem, size_class);
+    mem->free_blocks[size_class] = *(void **) block;
+    return block;
+}
+
+// size must be what p was allocated with
+static inline void mem_free(Memory *mem, void *p, size_t size) {
+    if (!p) return;
+    if (size > MAX_SLAB_ALLOC) {
+        free(p);
+        return;
+    }
+    size_t size_class = size ? (size - 1) / SLAB_GRANULE : 0;
+    *(void **) p = mem->free_blocks[size_class];
+    mem->free_blocks[size_class] = p;
+}
+
 Ang_Obj *new_object(Memory *mem, Ang_Type *type);
+// Marks the objects the roots refer to gray
 void mark_all_objects(Memory *mem);
+// Scans up to budget gray objects, returning 0 once there are none left
+int mark_gray(Memory *mem, size_t budget);
+/** Sweeps up to budget old objects, returning 0 once they're all swept
+ * Objects promoted while sweeping are ahead of the sweep, so left alone.
+ */
+int lazy_sweep(Memory *mem, size_t budget);
+// Finishes the sweep in progress, if any
 void sweep_mem(Memory *mem);
+// Promotes the nursery's reachable objects, leaving it empty
+void minor_gc(Memory *mem);
+// Collects everything unreachable, finishing any marking in progress
 void gc(Memory *mem);
 
-int push_stack(Memory *mem, Value val);
+// Keeps the object *root holds, if any, alive for as long as mem
+void add_root(Memory *mem, Value *root);
+void remember_object(Memory *mem, Ang_Obj *obj);
+
+static inline int in_nursery(const Memory *mem, const void *p) {
+    uintptr_t addr = (uintptr_t) p;
+    return addr >= (uintptr_t) mem->nursery
+        && addr < (uintptr_t) (mem->nursery + NURSERY_SIZE);
+}
+
+/** Must follow storing v into obj
+ * The stack, globals and registers are roots of every minor collection and
+ * marked again before marking finishes, so only stores into objects need it.
+ * It keeps marked objects from referring to unmarked ones while marking.
+ */
+static inline void write_barrier(Memory *mem, Ang_Obj *obj, Value v) {
+    if (!is_ptr(v) || in_nursery(mem, obj)) return;
+    Ang_Obj *target = get_ptr(v);
+    if (in_nursery(mem, target)) {
+        if (!obj->remembered) remember_object(mem, obj);
+    } else if (mem->marking && obj->marked) {
+        mark_ang_obj(target, &mem->gray);
+    }
+}
+
+// Running out of stack is caught by the guard pages
+static inline int push_stack(Memory *mem, Value val) {
+    mem->stack[mem->sp++] = val;
+    return 1;
+}
+
+// Returns a new frame on top of the call stack for the caller to fill in
+Call_Frame *push_frame(Memory *mem);
 
 Value pop_stack(Memory *mem);
+
+// Pops without checking for underflow, for code verify_code accepted
+static inline Value pop_unchecked(Memory *mem) {
+    return mem->stack[--mem->sp];
+}
+void popn_stack(Memory *mem, int n);
 int32_t pop_int(Memory *mem);
 double pop_double(Memory *mem);
 
+/** Operands of the register instructions
+ * The low bits select where the value lives and the rest index into it.
+ * Stack operands are popped when read and pushed when written. Immediates
+ * hold a zigzag encoded small integer. Temporaries are the slots just above
+ * the top of the stack, where nested instructions leave their results for the
+ * one using them, so nothing may be pushed while one is waiting to be read.
+ */
+typedef enum {
+    REG_STACK, REG_LOCAL, REG_GLOBAL, REG_VM, REG_IMM, REG_TEMP
+} Reg_Kind;
+
+#define REG_KIND_BITS 3
+#define REG_OPERAND(kind, index) \
+    (((uint32_t) (index) << REG_KIND_BITS) | (kind))
+#define MAX_REG_IMM (1 << 27)
+
+static inline Value read_reg_operand(Memory *mem, uint32_t operand) {
+    uint32_t index = operand >> REG_KIND_BITS;
+    switch (operand & ((1 << REG_KIND_BITS) - 1)) {
+    case REG_LOCAL:
+        return mem->stack[mem->fp + index];
+    case REG_GLOBAL:
+        return mem->gmem[index];
+    case REG_VM:
+        return mem->registers[index];
+    case REG_IMM:
+        return from_double((int32_t) (index >> 1) ^ -(int32_t) (index & 1));
+    case REG_TEMP:
+        return mem->stack[mem->sp + index];
+    default:
+        return pop_stack(mem);
+    }
+}
+
+static inline void write_reg_operand(Memory *mem, uint32_t operand, Value v) {
+    uint32_t index = operand >> REG_KIND_BITS;
+    switch (operand & ((1 << REG_KIND_BITS) - 1)) {
+    case REG_LOCAL:
+        mem->stack[mem->fp + index] = v;
+        break;
+    case REG_GLOBAL:
+        mem->gmem[index] = v;
+        break;
+    case REG_VM:
+        mem->registers[index] = v;
+        break;
+    case REG_TEMP:
+        mem->stack[mem->sp + index] = v;
+        break;
+    default:
+        push_stack(mem, v);
+        break;
+    }
+}
+
+static inline double num_value(Value v) {
+    return is_double(v) ? v.as_double : (double) v.as_int32;
+}
+
+static inline int32_t int_value(Value v) {
+    return is_double(v) ? (int32_t) v.as_double : v.as_int32;
+}
+
+// Whether two values are equal, numbers by value whichever way they're tagged
+static inline int values_equal(Value a, Value b) {
+    if ((is_int32(a) || is_double(a)) && (is_int32(b) || is_double(b))) {
+        if (is_int32(a) && is_int32(b)) return a.as_int32 == b.as_int32;
+        return num_value(a) == num_value(b);
+    }
+    return a.bits == b.bits;
+}
+
 #endif // ANG_MEM_H
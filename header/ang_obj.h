@@ -9,10 +9,33 @@ struct Ang_Obj {
     Value v;
     const Ang_Type *type;
     int marked;
-    Ang_Obj *next;
+    int remembered; // In its memory's remembered set
+    Ang_Obj *next; // Where a nursery object was promoted to, if it was
 };
 
-void mark_ang_obj(Ang_Obj *obj);
+/** Objects marked but not yet scanned, the gray ones of a collection
+ * White objects aren't marked and black ones are marked and have had the
+ * objects they refer to marked.
+ */
+typedef struct {
+    Ang_Obj **objs;
+    size_t length;
+    size_t capacity;
+} Mark_Stack;
+
+void ctor_mark_stack(Mark_Stack *gray);
+void dtor_mark_stack(Mark_Stack *gray);
+void push_mark_stack(Mark_Stack *gray, Ang_Obj *obj);
+
+// Marks obj gray, if it's white
+void mark_ang_obj(Ang_Obj *obj, Mark_Stack *gray);
+// Marks the objects obj refers to, making it black
+void scan_ang_obj(Ang_Obj *obj, Mark_Stack *gray);
+
+/** Calls visit on each object obj refers to, replacing the reference with
+ * what it returns
+ */
+void visit_ang_obj(Ang_Obj *obj, Value (*visit)(Value v, void *arg), void *arg);
 void print_ang_obj(const Value val);
 
 #endif // ANG_OBJ_H
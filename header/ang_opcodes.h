@@ -4,6 +4,7 @@
 #define OPCODES(code) \
     code(HALT, 0) \
     code(PUSH, 1) \
+    code(PUSH_INT, 1) \
     code(PUSOBJ, 2) \
     code(PUSH_0, 0) \
     code(POP, 0) \
@@ -16,12 +17,16 @@
     code(SUBF, 0) \
     code(MULF, 0) \
     code(DIVF, 0) \
-    code(LTZ, 0) \
-    code(GTZ, 0) \
+    code(LT, 0) \
+    code(LE, 0) \
+    code(GT, 0) \
+    code(GE, 0) \
+    code(EQ_NUM, 0) \
+    code(NE_NUM, 0) \
     code(EQ, 0) \
     code(NEG, 0) \
-    code(CMP_TYPE, 1) \
-    code(CMP_STRUCT, 1) \
+    code(CMP_TYPE, 2) \
+    code(CMP_STRUCT, 2) \
     code(JE, 1) \
     code(JNE, 1) \
     code(GSTORE, 1) \
@@ -30,13 +35,13 @@
     code(LOAD, 1) \
     code(STORET, 0) \
     code(PUSRET, 0) \
-    code(CONS_TUPLE, 2) \
+    code(MAKE_TUPLE, 2) \
+    code(UNPACK_TUPLE, 1) \
     code(LOAD_TUPLE, 0) \
-    code(SET_TUPLE, 1) \
     code(CONS_ARR, 2) \
     code(ACCESS_ARR, 0) \
     code(SET_ARR, 0) \
-    code(CONS_LAMBDA, 2) \
+    code(CONS_LAMBDA, 3) \
     code(SET_FP, 0) \
     code(RESET_FP, 0) \
     code(DUP, 0) \
@@ -48,7 +53,32 @@
     code(MOV_REG, 2) \
     code(JMP, 1) \
     code(CALL, 0) \
-    code(RET, 0)
+    code(TAIL_CALL, 0) \
+    code(RET, 0) \
+    /* Superinstructions produced by the peephole optimizer */ \
+    code(POPN_KEEP, 1) \
+    code(LOAD_SLOT, 1) \
+    /* Register instructions: destination, left and right operand */ \
+    code(ADD_R, 3) \
+    code(SUB_R, 3) \
+    code(MUL_R, 3) \
+    code(ADDF_R, 3) \
+    code(SUBF_R, 3) \
+    code(MULF_R, 3) \
+    code(DIVF_R, 3) \
+    code(LT_R, 3) \
+    code(LE_R, 3) \
+    code(GT_R, 3) \
+    code(GE_R, 3) \
+    code(EQ_R, 3) \
+    code(NE_R, 3) \
+    /* Quickened forms instructions rewrite themselves into when first run */ \
+    code(SET_DEFAULT_VAL_RESOLVED, 1) \
+    /* Type tests against primitives, which need no cache */ \
+    code(CMP_NUM, 1) \
+    code(CMP_BOOL, 1) \
+    code(CMP_NULL, 1) \
+    code(CMP_STRING, 1)
 
 #define DEFINE_ENUM_TYPE(type, _) type,
 typedef enum {
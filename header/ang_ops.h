@@ -0,0 +1,66 @@
+#ifndef ANG_OPS_H
+#define ANG_OPS_H
+
+#include "ang_mem.h"
+#include "ang_opcodes.h"
+#include "ang_primitives.h"
+
+/* What the instructions compute, for the interpreter, the JIT's helpers and
+ * the C written by --emit-c alike
+ */
+
+/* Integer operations are done in 64 bits so a result that overflows int32
+ * comes out as a double. Operands that are not int32 despite what the compiler
+ * inferred, such as an earlier overflow, take the double path.
+ */
+#define INT_CODE(left, right, op) \
+    (is_int32(left) && is_int32(right) \
+        ? from_double((int64_t) (left).as_int32 op (right).as_int32) \
+        : from_double(num_value(left) op num_value(right)))
+#define NUM_CODE(left, right, op) from_double(num_value(left) op num_value(right))
+/* Numbers compare exactly as int32 and otherwise as doubles, where NaN is
+ * unordered and so only unequal to anything
+ */
+#define NUM_CMP(left, right, op) \
+    (is_int32(left) && is_int32(right) \
+        ? (left).as_int32 op (right).as_int32 \
+        : num_value(left) op num_value(right))
+#define BOOL_CODE(cond) ((cond) ? true_val : false_val)
+
+// Test standing in for a CMP_TYPE against t2, or CMP_TYPE if there is none
+static inline Opcode primitive_cmp(const Ang_Type *t2) {
+    if (t2->cat != PRIMITIVE) return CMP_TYPE;
+    switch (t2->id) {
+    case NUM_TYPE:
+        return CMP_NUM;
+    case BOOL_TYPE:
+        return CMP_BOOL;
+    case NULL_TYPE:
+        return CMP_NULL;
+    case STRING_TYPE:
+        return CMP_STRING;
+    default:
+        return CMP_TYPE;
+    }
+}
+
+/** Result of the primitive type test quick on v against t2
+ * Unboxed values are told apart by their tag, objects by their type.
+ */
+static inline int quick_cmp_type(Opcode quick, Value v, const Ang_Type *t2) {
+    if (!is_nil(v) && !is_bool(v) && !is_int32(v) && !is_double(v)) {
+        return type_equality(((Ang_Obj *) get_ptr(v))->type, t2);
+    }
+    switch (quick) {
+    case CMP_NUM:
+        return is_int32(v) || is_double(v);
+    case CMP_BOOL:
+        return is_bool(v);
+    case CMP_NULL:
+        return is_nil(v);
+    default: // Strings are objects
+        return 0;
+    }
+}
+
+#endif // ANG_OPS_H
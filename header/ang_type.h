@@ -12,6 +12,14 @@ typedef enum {
     ARRAY
 } Type_Category;
 
+/** Memoized relations from a type to others, indexed by the other type's id
+ * Ids are handed out densely by the root compiler so the rows stay small.
+ */
+typedef struct {
+    uint8_t *memo;
+    size_t length;
+} Type_Relations;
+
 typedef struct {
     int id;
     const char *name;
@@ -20,6 +28,7 @@ typedef struct {
     Hashtable *slots;
     List *slot_types;
     int user_defined;
+    Type_Relations *relations;
 } Ang_Type;
 
 void ctor_ang_type(Ang_Type *type,
@@ -6,6 +6,9 @@
 #include "ang_mem.h"
 #include "list.h"
 #include "compiler.h"
+#include "ang_code.h"
+#include "ang_primitives.h"
+#include "jit.h"
 
 #define INSTR(vm) vm->compiler.instr
 
@@ -15,14 +18,51 @@ typedef struct {
     int trace;
     int enc_err;
 
+    // Limits on each run, checked at calls and backward jumps
+    size_t budget; // Calls and backward jumps a run may make, 0 for no limit
+    double time_limit; // Seconds a run may take, 0 for no limit
+    int interrupt; // Only accessed atomically, see interrupt_vm
+
+    Code code;
     Compiler compiler;
+    Jit jit;
 } Ang_VM;
 
-void ctor_ang_vm(Ang_VM *vm, size_t gmem_size);
+void ctor_ang_vm(Ang_VM *vm,
+        size_t gmem_size,
+        size_t stack_size,
+        size_t max_stack_size);
 void dtor_ang_vm(Ang_VM *vm);
 
-Value get_next_op(Ang_VM *vm);
+/** Runs the loaded code from the instruction pointer until it halts
+ */
 void eval(Ang_VM *vm);
+
+/** Drops everything that was running and resumes after the loaded code
+ */
+void abort_run(Ang_VM *vm);
+
+/** Stops vm's run at its next safepoint with an INTERRUPTED error
+ * The flag is set and taken with the GNU atomic builtins, so a host thread
+ * or a signal handler can call this while vm runs on another thread.
+ */
+void interrupt_vm(Ang_VM *vm);
+
+// Makes the primitive types known to vm's compiler
+void add_primitive_types(Ang_VM *vm, Primitive_Types *defaults);
+
+// Returned by the call helpers when the run was aborted
+#define CALL_ABORTED SIZE_MAX
+
+/** Calls the lambda under the argument on the stack, returning its entry
+ * ret is the ip to return to. Aborts the run if there's no lambda to call.
+ */
+size_t call_lambda(Ang_VM *vm, size_t ret);
+// Same as call_lambda, but replaces the current frame
+size_t tail_call_lambda(Ang_VM *vm);
+// Returns from the current lambda, returning the ip to carry on from
+size_t return_lambda(Ang_VM *vm);
+
 int fetch(const Ang_VM *vm);
 
 int emit_op(Ang_VM *vm, Value op);
@@ -31,6 +71,9 @@ void push_num_stack(Ang_VM *vm, double num);
 
 void run_compiled_instructions(Ang_VM *vm, Compiler *c);
 
+/** Compiles and loads code without running it
+ */
+void load_script(Ang_VM *vm, const char *code, const char *src_name);
 void run_code(Ang_VM *vm, const char *code, const char *src_name);
 
 #endif // ANG_VM_H
@@ -0,0 +1,41 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "ang_vm.h"
+#include "ang_ops.h"
+
+/* Support for the C that --emit-c writes. A compiled program embeds its
+ * source, which is compiled again at startup for the types and constants its
+ * code refers to, and runs its translated code in place of the interpreter.
+ */
+
+// Compiled code keeps the stack and frame pointers in the locals sp and fp
+#define AOT_PUSH(v) (*sp++ = (v))
+#define AOT_POP() (*--sp)
+// Hands sp to, and takes it back from, anything using the stack in memory
+#define AOT_SAVE() (vm->mem.sp = sp - vm->mem.stack)
+#define AOT_LOAD() \
+    (sp = vm->mem.stack + vm->mem.sp, fp = vm->mem.stack + vm->mem.fp)
+
+void aot_pusobj(Ang_VM *vm, Value type, Value v);
+void aot_make_tuple(Ang_VM *vm, Value type, int num_slots);
+void aot_cons_arr(Ang_VM *vm, Value type, int num_ele);
+void aot_cons_lambda(Ang_VM *vm, Value type, size_t ip, int nenv);
+
+/** Tests v's type against t2 through the inline cache
+ */
+int aot_cmp_type(Ang_VM *vm, Value v, Value t2, size_t cache, int structural);
+
+/** Runs a compiled program
+ * reg_vm is whether the source was compiled for the register instructions.
+ * Returns 0 if it compiled and ran without errors. Fails without running
+ * anything if the source no longer loads into the code that was compiled.
+ */
+int run_compiled(const char *source,
+        const char *src_name,
+        int reg_vm,
+        size_t length,
+        uint32_t checksum,
+        void (*run)(void *vm));
+
+#endif // AOT_H
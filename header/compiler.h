@@ -16,6 +16,12 @@ struct Compiler{
 
     Compiler *parent;
     List jmp_locs;
+
+    int reg_vm; // Emit register instructions for numeric expressions
+    int num_temps; // Temporaries holding results of nested register instructions
+    int closure; // Starts a lambda's frame, outer locals are only captures
+    int num_caches; // Inline cache slots handed out, kept by the root
+    int num_type_ids; // Type ids handed out, kept by the root
 };
 
 void ctor_compiler(Compiler *compiler);
@@ -0,0 +1,18 @@
+#ifndef EMIT_C_H
+#define EMIT_C_H
+
+#include <stdio.h>
+#include "ang_vm.h"
+
+/** Writes a C program running vm's loaded code without the interpreter
+ * Each instruction is translated to the C doing what it does, with jumps
+ * becoming gotos and the types the compiler settled, like the numeric
+ * instructions and type tests against primitives, fixed in the code. The
+ * program embeds source, the script the code was compiled from, and how the
+ * compiler was set up to compile it, and is linked against the runtime.
+ * Returns 0 if the code hasn't been verified, which the translation relies on,
+ * or has an instruction without a translation.
+ */
+int emit_c(const Ang_VM *vm, const char *source, const char *src_name, FILE *out);
+
+#endif // EMIT_C_H
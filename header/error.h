@@ -24,6 +24,10 @@
     code(INVALID_LAMBDA_PARAM) \
     code(NON_LAMBDA_CALL) \
     code(ARR_OUT_OF_BOUNDS) \
+    code(INTERRUPTED) \
+    code(BUDGET_EXHAUSTED) \
+    code(DEADLINE_EXCEEDED) \
+    code(STALE_PROGRAM) \
 
 #define DEFINE_ENUM_CODE(type) type,
 typedef enum {
@@ -0,0 +1,61 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "ang_code.h"
+#include "ang_mem.h"
+
+// Native code is only generated for x86-64 Linux
+#if defined(__x86_64__) && defined(__linux__) && !defined(ANG_NO_JIT)
+#define ANG_JIT
+#endif
+
+// Calls before a lambda gets compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+/** Native code for the lambda entered at entry
+ * Every instruction from entry up to the lambda's end is translated by
+ * copying its machine code template, with stack and register accesses turned
+ * into constant offsets. Instructions without a template, like the ones that
+ * allocate or call, exit back to the interpreter, which carries on from them.
+ */
+typedef struct {
+    size_t entry;
+    size_t calls;
+    int failed; // Couldn't be compiled, so stays interpreted
+    size_t start, end; // Instructions covered
+    uint32_t *offsets; // Native offset of each instruction, by ip - start
+    uint8_t *native;
+    size_t native_size;
+} Jit_Function;
+
+typedef struct {
+    int enabled;
+    Jit_Function **functions; // Sorted by entry
+    size_t num_functions;
+} Jit;
+
+void ctor_jit(Jit *jit);
+void dtor_jit(Jit *jit);
+
+/** Counts a call to the lambda at entry, compiling it once it is hot
+ * Returns its native code, or 0 if it has none.
+ */
+const Jit_Function *jit_call(Jit *jit, const Code *code, size_t entry);
+
+/** Returns the native code of the lambda at entry, or 0 if it has none
+ */
+const Jit_Function *jit_find(const Jit *jit, size_t entry);
+
+/** Returns where f's native code runs the instruction at ip, or 0 if ip
+ * isn't one of its instructions
+ */
+const void *jit_address(const Jit_Function *f, size_t ip);
+
+/** Runs f's native code from target until it exits
+ * Returns the ip of the instruction to resume interpreting at.
+ */
+size_t jit_run(const Jit_Function *f, const void *target, Memory *mem);
+
+#endif // JIT_H
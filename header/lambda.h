@@ -8,10 +8,12 @@ typedef struct {
     int ip;
     int nenv;
     Value *env;
+    int depth; // Most values its frame holds, -1 if unknown
 } Lambda;
 
-void save_lambda_env(Lambda *l, const Memory *mem);
+// Pops the nenv values the lambda captures into its env
+void save_lambda_env(Lambda *l, Memory *mem, int nenv);
 void load_lambda_env(const Lambda *l, Memory *mem);
-void destroy_lambda(Lambda *l);
+void destroy_lambda(Lambda *l, Memory *mem);
 
 #endif // LAMBDA_H
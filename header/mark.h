@@ -0,0 +1,31 @@
+#ifndef MARK_H
+#define MARK_H
+
+#include "ang_mem.h"
+
+/* Marking can be split across threads with pthreads and the GNU atomic
+ * builtins. Define ANG_NO_MARK_THREADS to always mark on the calling thread.
+ */
+#if defined(__GNUC__) && defined(__unix__) && !defined(ANG_NO_MARK_THREADS)
+#define ANG_MARK_THREADS
+#endif
+
+#define MAX_MARK_THREADS 64
+
+/** Threads kept waiting between pauses to finish the marking with the
+ * pausing thread
+ */
+typedef struct Mark_Pool Mark_Pool;
+
+// Returns 0 if no thread besides the caller's could be started
+Mark_Pool *start_mark_pool(size_t num_markers);
+void stop_mark_pool(Mark_Pool *pool);
+
+/** Marks everything reachable from mem's roots and gray objects
+ * The roots are split across the markers of mem's pool, which steal gray
+ * objects from each other as they run out. Without a pool it all happens on
+ * the calling thread. Leaves mem's gray stack empty.
+ */
+void parallel_mark(Memory *mem);
+
+#endif // MARK_H
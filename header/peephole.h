@@ -0,0 +1,13 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "list.h"
+
+/** Rewrites common instruction sequences of instr from start onwards into
+ * superinstructions
+ * Jumps and lambda addresses in the range are relocated to the rewritten
+ * code. Sequences are never fused across a jump target.
+ */
+void optimize_instr(List *instr, size_t start);
+
+#endif // PEEPHOLE_H
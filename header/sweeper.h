@@ -0,0 +1,30 @@
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#include "list.h"
+
+/* Payloads can be freed on a thread of their own with pthreads. Define
+ * ANG_NO_SWEEP_THREAD to always free them on the sweeping thread.
+ */
+#if defined(__GNUC__) && defined(__unix__) && !defined(ANG_NO_SWEEP_THREAD)
+#define ANG_SWEEP_THREAD
+#endif
+
+/** Frees the strings and list contents of swept objects in the background
+ * They come straight from malloc, unlike the objects, list headers and
+ * lambdas, which go back to free lists only the mutator's thread uses.
+ */
+typedef struct Sweeper Sweeper;
+
+// Returns 0 if there's no thread to free on
+Sweeper *start_sweeper(void);
+// Returns once everything handed to s has been freed
+void stop_sweeper(Sweeper *s);
+
+void sweep_string(Sweeper *s, char *str);
+// Only l's contents are freed, so its header can be reused right away
+void sweep_list(Sweeper *s, List l);
+// Hands what's been swept since the last flush over to be freed
+void flush_sweeper(Sweeper *s);
+
+#endif // SWEEPER_H
@@ -0,0 +1,15 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "ang_code.h"
+
+/** Checks the code loaded from start onwards never pops below the frame it
+ * runs in and that every path reaching an instruction agrees on the depth
+ * Each lambda body is checked as its own frame. The deepest each frame gets
+ * is recorded in the code's frame depths. Returns 0 if the code can't be
+ * verified, or if the code before start wasn't, in which case it has to run
+ * with checked stack operations.
+ */
+int verify_code(Code *code, size_t start);
+
+#endif // VERIFIER_H
@@ -36,6 +36,9 @@ Ast *copy_ast(Ast *ast) {
         add_child(copy, copy_ast(get_child(ast, i)));
     }
     copy->eval_type = ast->eval_type;
+    copy->known_int = ast->known_int;
+    copy->tail = ast->tail;
+    copy->discarded = ast->discarded;
     return copy;
 }
 
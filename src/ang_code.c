@@ -0,0 +1,289 @@
+#include "ang_code.h"
+
+#include <string.h>
+
+void ctor_code(Code *code) {
+    code->capacity = 256;
+    code->bytes = calloc(code->capacity, sizeof(uint8_t));
+    code->length = 0;
+    code->bytes[0] = HALT;
+
+    code->consts_capacity = 16;
+    code->consts = calloc(code->consts_capacity, sizeof(Value));
+    code->num_consts = 0;
+    code->index_capacity = 32;
+    code->const_index = calloc(code->index_capacity, sizeof(uint32_t));
+
+    code->caches = 0;
+    code->num_caches = 0;
+
+    code->frame_depths = 0;
+    code->num_frame_depths = 0;
+    code->verified = 0;
+
+    code->loaded = 0;
+}
+
+void dtor_code(Code *code) {
+    free(code->bytes);
+    free(code->consts);
+    free(code->const_index);
+    free(code->caches);
+    free(code->frame_depths);
+    code->bytes = 0;
+    code->consts = 0;
+    code->const_index = 0;
+    code->caches = 0;
+    code->num_caches = 0;
+    code->frame_depths = 0;
+    code->num_frame_depths = 0;
+    code->verified = 0;
+    code->length = 0;
+    code->num_consts = 0;
+    code->loaded = 0;
+}
+
+Operand_Kind operand_kind(Opcode op, int operand) {
+    switch (op) {
+    case PUSH_INT:
+        return OPERAND_INT;
+    case PUSH:
+    case PUSOBJ:
+    case SET_DEFAULT_VAL:
+    case SET_DEFAULT_VAL_RESOLVED:
+    case LOAD_DEFAULT_VAL:
+        return OPERAND_CONST;
+    case MAKE_TUPLE:
+    case CONS_ARR:
+        return operand == 0 ? OPERAND_CONST : OPERAND_UINT;
+    case CONS_LAMBDA:
+        if (operand == 0) return OPERAND_CONST;
+        return operand == 1 ? OPERAND_ADDR : OPERAND_UINT;
+    case CMP_TYPE:
+    case CMP_STRUCT:
+        return operand == 0 ? OPERAND_CONST : OPERAND_CACHE;
+    case CMP_NUM:
+    case CMP_BOOL:
+    case CMP_NULL:
+    case CMP_STRING:
+        return OPERAND_CONST;
+    case JE:
+    case JNE:
+    case JMP:
+        return OPERAND_ADDR;
+    default:
+        return OPERAND_UINT;
+    }
+}
+
+static size_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (size_t) bits;
+}
+
+static void grow_const_index(Code *code) {
+    free(code->const_index);
+    code->index_capacity *= 2;
+    code->const_index = calloc(code->index_capacity, sizeof(uint32_t));
+    size_t mask = code->index_capacity - 1;
+    for (size_t i = 0; i < code->num_consts; i++) {
+        size_t slot = hash_bits(code->consts[i].bits) & mask;
+        while (code->const_index[slot]) slot = (slot + 1) & mask;
+        code->const_index[slot] = i + 1;
+    }
+}
+
+uint32_t add_const(Code *code, Value v) {
+    size_t mask = code->index_capacity - 1;
+    size_t slot = hash_bits(v.bits) & mask;
+    // Index entries are offset by one so zero marks an empty slot
+    while (code->const_index[slot]) {
+        uint32_t i = code->const_index[slot] - 1;
+        if (code->consts[i].bits == v.bits) return i;
+        slot = (slot + 1) & mask;
+    }
+    if (code->num_consts == code->consts_capacity) {
+        code->consts_capacity *= 2;
+        code->consts = realloc(code->consts, code->consts_capacity * sizeof(Value));
+    }
+    uint32_t i = code->num_consts++;
+    code->consts[i] = v;
+    code->const_index[slot] = i + 1;
+    if (code->num_consts * 2 > code->index_capacity) grow_const_index(code);
+    return i;
+}
+
+// Makes sure there are caches up to and including slot
+static void reserve_cache(Code *code, size_t slot) {
+    if (slot < code->num_caches) return;
+    code->caches = realloc(code->caches, (slot + 1) * sizeof(Inline_Cache));
+    memset(code->caches + code->num_caches, 0,
+        (slot + 1 - code->num_caches) * sizeof(Inline_Cache));
+    code->num_caches = slot + 1;
+}
+
+static int uint_size(uint32_t n) {
+    int size = 1;
+    while (n >= 0x80) {
+        n >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static uint32_t zigzag(int32_t n) {
+    return ((uint32_t) n << 1) ^ (uint32_t) (n >> 31);
+}
+
+static void write_uint(Code *code, uint32_t n) {
+    while (n >= 0x80) {
+        code->bytes[code->length++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    code->bytes[code->length++] = n;
+}
+
+// Opcode the instruction at i is encoded with
+static Opcode packed_op(const List *instr, size_t i) {
+    Opcode op = access_list(instr, i).as_int32;
+    if (op == PUSH && is_int32(access_list(instr, i + 1))) return PUSH_INT;
+    return op;
+}
+
+// Encoded operand for everything but addresses, which depend on the layout
+static uint32_t packed_operand(Code *code, Opcode op, int i, Value operand) {
+    switch (operand_kind(op, i)) {
+    case OPERAND_INT:
+        return zigzag(operand.as_int32);
+    case OPERAND_CONST:
+        return add_const(code, operand);
+    default:
+        return operand.as_int32;
+    }
+}
+
+void load_code(Code *code, const List *instr) {
+    size_t start = code->loaded;
+    size_t n = instr->length - start;
+    size_t *offsets = calloc(n + 1, sizeof(size_t));
+
+    /* Lay the instructions out until no offset changes. Address operands are
+     * sized with the previous layout so they start at one byte and only grow.
+     */
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        size_t pos = code->length;
+        size_t i = 0;
+        while (i < n) {
+            Opcode ir_op = access_list(instr, start + i).as_int32;
+            Opcode op = packed_op(instr, start + i);
+            size_t op_pos = pos++;
+            for (int j = 0; j < num_ops(ir_op); j++) {
+                Value operand = access_list(instr, start + i + 1 + j);
+                if (operand_kind(op, j) == OPERAND_ADDR) {
+                    size_t target = operand.as_int32 - start;
+                    pos += uint_size(target <= n ? offsets[target] : 0);
+                } else {
+                    pos += uint_size(packed_operand(code, op, j, operand));
+                }
+            }
+            for (int j = 0; j <= num_ops(ir_op) && i < n; j++, i++) {
+                if (offsets[i] != op_pos) changed = 1;
+                offsets[i] = op_pos;
+            }
+        }
+        if (offsets[n] != pos) changed = 1;
+        offsets[n] = pos;
+    }
+
+    if (offsets[n] + 1 > code->capacity) {
+        while (offsets[n] + 1 > code->capacity) code->capacity *= 2;
+        code->bytes = realloc(code->bytes, code->capacity);
+    }
+    size_t i = 0;
+    while (i < n) {
+        Opcode ir_op = access_list(instr, start + i).as_int32;
+        Opcode op = packed_op(instr, start + i);
+        code->bytes[code->length++] = op;
+        for (int j = 0; j < num_ops(ir_op); j++) {
+            Value operand = access_list(instr, start + i + 1 + j);
+            if (operand_kind(op, j) == OPERAND_ADDR) {
+                size_t target = operand.as_int32 - start;
+                write_uint(code, target <= n ? offsets[target] : 0);
+            } else {
+                if (operand_kind(op, j) == OPERAND_CACHE) {
+                    reserve_cache(code, operand.as_int32);
+                }
+                write_uint(code, packed_operand(code, op, j, operand));
+            }
+        }
+        i += 1 + num_ops(ir_op);
+    }
+    code->bytes[code->length] = HALT;
+    code->loaded = instr->length;
+    free(offsets);
+}
+
+int patch_uint(uint8_t *at, size_t length, uint32_t n) {
+    if ((size_t) uint_size(n) > length) return 0;
+    for (size_t i = 0; i + 1 < length; i++) {
+        at[i] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    at[length - 1] = n;
+    return 1;
+}
+
+void add_frame_depth(Code *code, size_t entry, int depth) {
+    code->frame_depths = realloc(code->frame_depths,
+        (code->num_frame_depths + 1) * sizeof(Frame_Depth));
+    size_t i = code->num_frame_depths++;
+    for (; i > 0 && code->frame_depths[i - 1].entry > entry; i--) {
+        code->frame_depths[i] = code->frame_depths[i - 1];
+    }
+    code->frame_depths[i] = (Frame_Depth) { entry, depth };
+}
+
+int frame_depth(const Code *code, size_t entry) {
+    size_t lo = 0;
+    size_t hi = code->num_frame_depths;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (code->frame_depths[mid].entry < entry) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < code->num_frame_depths && code->frame_depths[lo].entry == entry) {
+        return code->frame_depths[lo].depth;
+    }
+    return -1;
+}
+
+uint32_t code_checksum(const Code *code) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < code->length; i++) {
+        hash = (hash ^ code->bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+Value read_operand(const Code *code, Operand_Kind kind, size_t *offset) {
+    const uint8_t *pc = code->bytes + *offset;
+    Value v;
+    switch (kind) {
+    case OPERAND_INT:
+        v = from_double(read_int(&pc));
+        break;
+    case OPERAND_CONST:
+        v = code->consts[read_uint(&pc)];
+        break;
+    default:
+        v = from_double(read_uint(&pc));
+        break;
+    }
+    *offset = pc - code->bytes;
+    return v;
+}
@@ -8,9 +8,11 @@ void print_stack_trace(const Ang_VM *vm) {
     int sp = vm->mem.sp;
     int lenOffset = 40 - strlen(opcode_to_str(op)) - num_ops(op); // Length necessary to offset stack print.
     fprintf(stderr, "%04d: %s ", ip, opcode_to_str(op));
+    size_t offset = ip + 1;
     for (int i = 0; i < num_ops(op); i++) {
-        fprintf(stderr, "%d ", access_list(&INSTR(vm), ip + i + 1).as_int32);
-        lenOffset -= num_digits(access_list(&INSTR(vm), ip + i + 1).as_int32);
+        Value operand = read_operand(&vm->code, operand_kind(op, i), &offset);
+        fprintf(stderr, "%d ", operand.as_int32);
+        lenOffset -= num_digits(operand.as_int32);
     }
     fprintf(stderr, "%*s", lenOffset, "[ ");
     for (int i = 0; i < sp; i++) {
@@ -19,3 +21,21 @@ void print_stack_trace(const Ang_VM *vm) {
     }
     fprintf(stderr, "]\n");
 }
+
+void print_backtrace(const Ang_VM *vm) {
+    // Deep recursion mostly repeats itself so only the ends are printed
+    const size_t shown = 10;
+    size_t n = vm->mem.num_frames;
+    for (size_t i = n; i > 0; i--) {
+        if (n > 2 * shown && i == n - shown) {
+            fprintf(stderr, "    ... %zu more calls\n", n - 2 * shown);
+            i = shown + 1;
+            continue;
+        }
+        const Call_Frame *frame = &vm->mem.frames[i - 1];
+        fprintf(stderr, "    in <%s> at %04d, returning to %04d\n",
+            frame->closure->type->name,
+            frame->callee,
+            frame->ip);
+    }
+}
@@ -57,6 +57,7 @@ void dtor_ang_env(Ang_Env *env) {
             dtor_ang_type(t);
             free(t);
         } else if (t->user_defined) {
+            dtor_ang_type(t);
             free(t);
         }
         t = 0;
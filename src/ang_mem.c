@@ -1,17 +1,148 @@
+#define _DEFAULT_SOURCE // mmap and sigaction aren't part of C99
 #include "ang_mem.h"
 
 #include "error.h"
 #include "ang_primitives.h"
 #include "lambda.h"
-#include <stdio.h>
+#include "mark.h"
+#include "sweeper.h"
+#include <string.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-void ctor_memory(Memory *mem, size_t gmem_size) {
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// The stack whose faults are being handled and where to go on overflow
+static Memory *guarded_mem = 0;
+static sigjmp_buf *overflow_jmp = 0;
+
+static size_t page_size(void) {
+    return sysconf(_SC_PAGESIZE);
+}
+
+// Bytes needed for size values, rounded up to whole pages
+static size_t stack_bytes(size_t size) {
+    size_t page = page_size();
+    return (size * sizeof(Value) + page - 1) / page * page;
+}
+
+// Makes the first size values of the stack accessible
+static int commit_stack(Memory *mem, size_t size) {
+    size_t bytes = stack_bytes(size);
+    if (mprotect(mem->stack, bytes, PROT_READ | PROT_WRITE)) return 0;
+    mem->stack_size = bytes / sizeof(Value);
+    return 1;
+}
+
+static void reserve_stack(Memory *mem, size_t stack_size, size_t max_stack_size) {
+    if (max_stack_size < stack_size) max_stack_size = stack_size;
+    size_t reserved = stack_bytes(max_stack_size);
+    // The extra page is never made accessible and catches overflows
+    void *stack = mmap(0, reserved + page_size(), PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+        runtime_error(STACK_OVERFLOW, "Could not reserve the stack\n");
+        exit(1);
+    }
+    mem->stack = stack;
+    mem->max_stack_size = reserved / sizeof(Value);
+    mem->stack_size = 0;
+    commit_stack(mem, stack_size);
+}
+
+static void stack_fault(int sig, siginfo_t *info, void *context) {
+    (void) context;
+    Memory *mem = guarded_mem;
+    char *addr = info->si_addr;
+    if (mem) {
+        char *base = (char *) mem->stack;
+        char *limit = (char *) (mem->stack + mem->max_stack_size);
+        if (addr >= base && addr < limit + page_size()) {
+            if (addr < limit) {
+                size_t needed = (addr - base) / sizeof(Value) + 1;
+                size_t size = mem->stack_size * 2;
+                if (size < needed) size = needed;
+                if (size > mem->max_stack_size) size = mem->max_stack_size;
+                if (commit_stack(mem, size)) return;
+            }
+            siglongjmp(*overflow_jmp, 1);
+        }
+    }
+    // Not a stack fault, so let it take the default action when it repeats
+    signal(sig, SIG_DFL);
+}
+
+int run_stack_guarded(Memory *mem, void (*run)(void *), void *arg) {
+    static int installed = 0;
+    if (!installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = stack_fault;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &action, 0);
+        sigaction(SIGBUS, &action, 0); // Some systems fault with SIGBUS
+        installed = 1;
+    }
+    Memory *prev_mem = guarded_mem;
+    sigjmp_buf *prev_jmp = overflow_jmp;
+    sigjmp_buf jmp;
+    if (!sigsetjmp(jmp, 1)) {
+        guarded_mem = mem;
+        overflow_jmp = &jmp;
+        run(arg);
+        guarded_mem = prev_mem;
+        overflow_jmp = prev_jmp;
+        return 1;
+    }
+    guarded_mem = prev_mem;
+    overflow_jmp = prev_jmp;
+    return 0;
+}
+
+void grow_stack(Memory *mem, size_t size) {
+    if (size <= mem->stack_size) return;
+    size_t grown = mem->stack_size * 2;
+    if (grown < size) grown = size;
+    if (grown > mem->max_stack_size) grown = mem->max_stack_size;
+    if (size > grown || !commit_stack(mem, grown)) siglongjmp(*overflow_jmp, 1);
+}
+
+void ctor_memory(Memory *mem,
+        size_t gmem_size,
+        size_t stack_size,
+        size_t max_stack_size) {
+    reserve_stack(mem, stack_size, max_stack_size);
+    mem->frames_capacity = DEFAULT_FRAMES;
+    mem->frames = calloc(mem->frames_capacity, sizeof(Call_Frame));
+    mem->num_frames = 0;
     mem->gmem = calloc(sizeof(Value*), gmem_size);
     mem->gmem_size = gmem_size;
     mem->global_size = 0;
+    mem->nursery = malloc(NURSERY_SIZE * sizeof(Ang_Obj));
+    mem->nursery_used = 0;
     mem->num_objects = 0;
-    mem->max_objects = 50; // Arbitrary currently
+    mem->max_objects = NURSERY_SIZE;
     mem->mem_head = 0;
+    mem->marking = 0;
+    ctor_mark_stack(&mem->gray);
+    mem->mark_pool = 0;
+    mem->sweep = 0;
+    mem->sweeper = 0;
+    mem->remembered = 0;
+    mem->num_remembered = 0;
+    mem->remembered_capacity = 0;
+    mem->roots = 0;
+    mem->num_roots = 0;
+    mem->roots_capacity = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        mem->free_blocks[i] = 0;
+    }
+    mem->slabs = 0;
     for (int i = 0; i < NUM_REGISTERS; i++) {
         mem->registers[i] = nil_val;
     }
@@ -23,90 +154,272 @@ void ctor_memory(Memory *mem, size_t gmem_size) {
 void dtor_memory(Memory *mem) {
     // Set stack pointer and gmem_size to 0 so all objects get collected
     mem->sp = 0;
+    mem->num_frames = 0;
     mem->global_size = 0;
     for (int i = 0; i < NUM_REGISTERS; i++) {
         mem->registers[i] = nil_val;
     }
+    mem->num_roots = 0;
+    // Drop any marking in progress
+    mem->marking = 0;
+    mem->gray.length = 0;
+    for (Ang_Obj *obj = mem->mem_head; obj; obj = obj->next) {
+        obj->marked = 0;
+    }
     gc(mem);
+    if (mem->mark_pool) stop_mark_pool(mem->mark_pool);
+    mem->mark_pool = 0;
+    if (mem->sweeper) stop_sweeper(mem->sweeper);
+    mem->sweeper = 0;
+    free(mem->nursery);
+    mem->nursery = 0;
+    dtor_mark_stack(&mem->gray);
+    free(mem->remembered);
+    mem->remembered = 0;
+    free(mem->roots);
+    mem->roots = 0;
+    while (mem->slabs) {
+        void *slab = mem->slabs;
+        mem->slabs = *(void **) slab;
+        free(slab);
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        mem->free_blocks[i] = 0;
+    }
     free(mem->gmem);
     mem->gmem = 0;
+    munmap(mem->stack, stack_bytes(mem->max_stack_size) + page_size());
+    mem->stack = 0;
+    free(mem->frames);
+    mem->frames = 0;
+}
+
+void *new_slab(Memory *mem, size_t size_class) {
+    char *slab = malloc(SLAB_BYTES);
+    *(void **) slab = mem->slabs;
+    mem->slabs = slab;
+    // The first granule links the slabs, the rest is cut into blocks
+    size_t block_size = (size_class + 1) * SLAB_GRANULE;
+    char *first = slab + SLAB_GRANULE;
+    size_t num_blocks = (SLAB_BYTES - SLAB_GRANULE) / block_size;
+    for (size_t i = num_blocks - 1; i > 0; i--) {
+        void *block = first + i * block_size;
+        *(void **) block = mem->free_blocks[size_class];
+        mem->free_blocks[size_class] = block;
+    }
+    return first;
+}
+
+static void finish_marking(Memory *mem) {
+    // The roots aren't behind the write barrier, so they're marked again
+    parallel_mark(mem);
+    mem->marking = 0;
+    mem->sweep = &mem->mem_head;
 }
 
 Ang_Obj *new_object(Memory *mem, Ang_Type *type) {
-    if (mem->num_objects >= mem->max_objects) gc(mem);
-    Ang_Obj *obj = calloc(sizeof(Ang_Obj), 1);
+    if (mem->nursery_used == NURSERY_SIZE) {
+        // Sweeping first frees blocks for the promoted objects
+        lazy_sweep(mem, SWEEP_SLICE);
+        minor_gc(mem);
+        if (mem->marking) {
+            if (!mark_gray(mem, MARK_SLICE)) finish_marking(mem);
+        } else if (!mem->sweep && mem->num_objects >= mem->max_objects) {
+            mem->marking = 1;
+            mark_all_objects(mem);
+        }
+    }
+    Ang_Obj *obj = &mem->nursery[mem->nursery_used++];
+    memset(obj, 0, sizeof(Ang_Obj));
     obj->type = type;
-    obj->marked = 0;
-
-    obj->next = mem->mem_head;
-    mem->mem_head = obj;
-    mem->num_objects++;
     return obj;
 }
 
+void add_root(Memory *mem, Value *root) {
+    for (size_t i = 0; i < mem->num_roots; i++) {
+        if (mem->roots[i] == root) return;
+    }
+    if (mem->num_roots == mem->roots_capacity) {
+        mem->roots_capacity = mem->roots_capacity ? mem->roots_capacity * 2 : 8;
+        mem->roots = realloc(mem->roots, mem->roots_capacity * sizeof(Value *));
+    }
+    mem->roots[mem->num_roots++] = root;
+}
+
+void remember_object(Memory *mem, Ang_Obj *obj) {
+    if (mem->num_remembered == mem->remembered_capacity) {
+        mem->remembered_capacity =
+            mem->remembered_capacity ? mem->remembered_capacity * 2 : 64;
+        mem->remembered = realloc(mem->remembered,
+            mem->remembered_capacity * sizeof(Ang_Obj *));
+    }
+    mem->remembered[mem->num_remembered++] = obj;
+    obj->remembered = 1;
+}
+
 void mark_all_objects(Memory *mem) {
     // Primitives are not wrapped in an Angstrom Object on the stack so we
     // check if they are ptr values.
     for (int i = 0; i < mem->sp; i++) {
         if (is_ptr(mem->stack[i])) {
-            printf("Stack: %p\n", get_ptr(mem->stack[i]));
-            mark_ang_obj(get_ptr(mem->stack[i]));
+            mark_ang_obj(get_ptr(mem->stack[i]), &mem->gray);
         }
     }
     for (size_t i = 0; i < mem->global_size; i++) {
         if (is_ptr(mem->gmem[i])) {
-            printf("GMEM: %p\n", get_ptr(mem->gmem[i]));
-            mark_ang_obj(get_ptr(mem->gmem[i]));
+            mark_ang_obj(get_ptr(mem->gmem[i]), &mem->gray);
         }
     }
     for (int i = 0; i < NUM_REGISTERS; i++) {
         if (is_ptr(mem->registers[i])) {
-            printf("Reg: %p\n", get_ptr(mem->registers[i]));
-            mark_ang_obj(get_ptr(mem->registers[i]));
+            mark_ang_obj(get_ptr(mem->registers[i]), &mem->gray);
+        }
+    }
+    for (size_t i = 0; i < mem->num_frames; i++) {
+        mark_ang_obj(mem->frames[i].closure, &mem->gray);
+    }
+    for (size_t i = 0; i < mem->num_roots; i++) {
+        if (is_ptr(*mem->roots[i])) {
+            mark_ang_obj(get_ptr(*mem->roots[i]), &mem->gray);
         }
     }
 }
 
-void sweep_mem(Memory *mem) {
-    Ang_Obj **obj = &mem->mem_head;
-    while (*obj) {
+int mark_gray(Memory *mem, size_t budget) {
+    for (size_t i = 0; i < budget && mem->gray.length; i++) {
+        scan_ang_obj(mem->gray.objs[--mem->gray.length], &mem->gray);
+    }
+    return mem->gray.length != 0;
+}
+
+static void free_payload(Memory *mem, Ang_Obj *obj) {
+    if (obj->type->id == STRING_TYPE) {
+        if (mem->sweeper) sweep_string(mem->sweeper, get_ptr(obj->v));
+        else free(get_ptr(obj->v));
+    } else if (obj->type->cat != LAMBDA) { // Is a user defined type
+        List *tuple_val = get_ptr(obj->v);
+        if (mem->sweeper) sweep_list(mem->sweeper, *tuple_val);
+        else dtor_list(tuple_val);
+        mem_free(mem, tuple_val, sizeof(List));
+    } else {
+        Lambda *l = get_ptr(obj->v);
+        destroy_lambda(l, mem);
+        mem_free(mem, l, sizeof(Lambda));
+    }
+}
+
+int lazy_sweep(Memory *mem, size_t budget) {
+    if (!mem->sweep) return 0;
+    Ang_Obj **obj = mem->sweep;
+    for (size_t i = 0; i < budget && *obj; i++) {
         if (!(*obj)->marked) {
-            if ((*obj)->type->id == STRING_TYPE) {
-                free(get_ptr((*obj)->v));
-            } else if ((*obj)->type->cat != LAMBDA) { // Is a user defined type
-                List *tuple_val = get_ptr((*obj)->v);
-                dtor_list(tuple_val);
-                free(tuple_val);
-                tuple_val = 0;
-            } else if ((*obj)->type->cat == LAMBDA) {
-                Lambda *l = get_ptr((*obj)->v);
-                destroy_lambda(l);
-                free(l);
-            }
+            free_payload(mem, *obj);
             Ang_Obj *unreachable = *obj;
             *obj = unreachable->next;
-            free(unreachable);
+            mem_free(mem, unreachable, sizeof(Ang_Obj));
             mem->num_objects--;
         } else {
             (*obj)->marked = 0;
             obj = &(*obj)->next;
         }
     }
+    if (mem->sweeper) flush_sweeper(mem->sweeper);
+    if (*obj) {
+        mem->sweep = obj;
+        return 1;
+    }
+    mem->sweep = 0;
+    mem->max_objects = mem->num_objects * 2;
+    if (mem->max_objects < NURSERY_SIZE) mem->max_objects = NURSERY_SIZE;
+    return 0;
+}
+
+void sweep_mem(Memory *mem) {
+    lazy_sweep(mem, SIZE_MAX);
+}
+
+// Returns where v's object lives once promoted
+static Value promote(Value v, void *arg) {
+    Memory *mem = arg;
+    Ang_Obj *obj = get_ptr(v);
+    if (!in_nursery(mem, obj)) {
+        // A promoted object may hold the only reference to an unmarked one
+        if (mem->marking) mark_ang_obj(obj, &mem->gray);
+        return v;
+    }
+    if (!obj->next) {
+        Ang_Obj *old = mem_alloc(mem, sizeof(Ang_Obj));
+        *old = *obj;
+        // Scanned with the rest of the promoted if marking, and kept by a
+        // sweep that has yet to move past mem_head
+        old->marked = mem->marking || mem->sweep == &mem->mem_head;
+        old->next = mem->mem_head;
+        mem->mem_head = old;
+        mem->num_objects++;
+        obj->next = old;
+    }
+    return from_ptr(obj->next);
+}
+
+static void promote_root(Memory *mem, Value *root) {
+    if (is_ptr(*root)) *root = promote(*root, mem);
+}
+
+void minor_gc(Memory *mem) {
+    Ang_Obj *scanned = mem->mem_head;
+    for (int i = 0; i < mem->sp; i++) {
+        promote_root(mem, &mem->stack[i]);
+    }
+    for (size_t i = 0; i < mem->global_size; i++) {
+        promote_root(mem, &mem->gmem[i]);
+    }
+    for (int i = 0; i < NUM_REGISTERS; i++) {
+        promote_root(mem, &mem->registers[i]);
+    }
+    for (size_t i = 0; i < mem->num_frames; i++) {
+        Value closure = from_ptr(mem->frames[i].closure);
+        promote_root(mem, &closure);
+        mem->frames[i].closure = get_ptr(closure);
+    }
+    for (size_t i = 0; i < mem->num_roots; i++) {
+        promote_root(mem, mem->roots[i]);
+    }
+    for (size_t i = 0; i < mem->num_remembered; i++) {
+        mem->remembered[i]->remembered = 0;
+        visit_ang_obj(mem->remembered[i], promote, mem);
+    }
+    mem->num_remembered = 0;
+    // Promoted objects are pushed onto mem_head, so scan from there until
+    // they stop promoting anything new
+    while (mem->mem_head != scanned) {
+        Ang_Obj *promoted = mem->mem_head;
+        for (Ang_Obj *obj = promoted; obj != scanned; obj = obj->next) {
+            visit_ang_obj(obj, promote, mem);
+        }
+        scanned = promoted;
+    }
+    for (size_t i = 0; i < mem->nursery_used; i++) {
+        if (!mem->nursery[i].next) free_payload(mem, &mem->nursery[i]);
+    }
+    mem->nursery_used = 0;
+    if (mem->sweeper) flush_sweeper(mem->sweeper);
 }
 
 void gc(Memory *mem) {
-    mark_all_objects(mem);
+    // Marks left over from the last cycle have to be swept away first
+    sweep_mem(mem);
+    minor_gc(mem);
+    mem->marking = 1;
+    finish_marking(mem);
     sweep_mem(mem);
-    mem->max_objects = mem->num_objects * 2;
 }
 
-int push_stack(Memory *mem, Value val) {
-    if (mem->sp >= MAX_STACK_SIZE) {
-        runtime_error(STACK_OVERFLOW, "Stack overflow");
-        return 0;
+Call_Frame *push_frame(Memory *mem) {
+    if (mem->num_frames == mem->frames_capacity) {
+        mem->frames_capacity *= 2;
+        mem->frames = realloc(mem->frames, mem->frames_capacity * sizeof(Call_Frame));
     }
-    mem->stack[mem->sp++] = val;
-    return 1;
+    return &mem->frames[mem->num_frames++];
 }
 
 Value pop_stack(Memory *mem) {
@@ -117,6 +430,15 @@ Value pop_stack(Memory *mem) {
     return mem->stack[--mem->sp];
 }
 
+void popn_stack(Memory *mem, int n) {
+    if (mem->sp < n) {
+        runtime_error(STACK_UNDERFLOW, "Stack underflow");
+        mem->sp = 0;
+        return;
+    }
+    mem->sp -= n;
+}
+
 int32_t pop_int(Memory *mem) {
     Value v = pop_stack(mem);
     return (is_double(v)
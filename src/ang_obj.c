@@ -4,23 +4,55 @@
 #include "lambda.h"
 #include "stdio.h"
 
-void mark_ang_obj(Ang_Obj *obj) {
-    if (!obj || obj->marked == 1) return;
+void ctor_mark_stack(Mark_Stack *gray) {
+    gray->objs = 0;
+    gray->length = 0;
+    gray->capacity = 0;
+}
+
+void dtor_mark_stack(Mark_Stack *gray) {
+    free(gray->objs);
+    gray->objs = 0;
+    gray->length = 0;
+    gray->capacity = 0;
+}
+
+void push_mark_stack(Mark_Stack *gray, Ang_Obj *obj) {
+    if (gray->length == gray->capacity) {
+        gray->capacity = gray->capacity ? gray->capacity * 2 : 256;
+        gray->objs = realloc(gray->objs, gray->capacity * sizeof(Ang_Obj *));
+    }
+    gray->objs[gray->length++] = obj;
+}
+
+void mark_ang_obj(Ang_Obj *obj, Mark_Stack *gray) {
+    if (!obj || obj->marked) return;
     obj->marked = 1;
+    push_mark_stack(gray, obj);
+}
+
+static Value mark_value(Value v, void *gray) {
+    mark_ang_obj(get_ptr(v), gray);
+    return v;
+}
+
+void scan_ang_obj(Ang_Obj *obj, Mark_Stack *gray) {
+    visit_ang_obj(obj, mark_value, gray);
+}
+
+void visit_ang_obj(Ang_Obj *obj, Value (*visit)(Value v, void *arg), void *arg) {
     if (obj->type->cat == PRODUCT || obj->type->cat == ARRAY) {
         List *slots = get_ptr(obj->v);
         for (size_t i = 0; i < slots->length; i++) {
             Value v = access_list(slots, i);
-            if (is_ptr(v)) {
-                mark_ang_obj(get_ptr(v));
-            }
+            if (!is_ptr(v)) continue;
+            Value moved = visit(v, arg);
+            if (moved.bits != v.bits) set_list(slots, i, moved);
         }
     } else if (obj->type->cat == LAMBDA) {
         Lambda *l = get_ptr(obj->v);
         for (int i = 0; i < l->nenv; i++) {
-            if (is_ptr(l->env[i])) {
-                mark_ang_obj(get_ptr(l->env[i]));
-            }
+            if (is_ptr(l->env[i])) l->env[i] = visit(l->env[i], arg);
         }
     }
 }
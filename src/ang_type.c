@@ -2,18 +2,42 @@
 
 #include "ang_primitives.h"
 #include <stdio.h>
+#include <string.h>
+
+// Bits of a memo entry
+#define EQUALITY_KNOWN 1
+#define EQUAL 2
+#define STRUCTURE_KNOWN 4
+#define STRUCTURE_EQUAL 8
 
 void ctor_ang_type(Ang_Type *type,
         int id,
         const char *name,
         Type_Category cat,
         Value default_val) {
-    *type = (Ang_Type) { id, name, cat, default_val, 0, 0, 0 };
+    *type = (Ang_Type) { id, name, cat, default_val, 0, 0, 0, 0 };
+    type->relations = calloc(1, sizeof(Type_Relations));
 }
 
 void dtor_ang_type(Ang_Type *type) {
     type->slots = 0;
     type->slot_types = 0;
+    if (type->relations) free(type->relations->memo);
+    free(type->relations);
+    type->relations = 0;
+}
+
+// Memo entry for t2 in t1's row, growing the row to fit
+static uint8_t *relation(const Ang_Type *t1, const Ang_Type *t2) {
+    Type_Relations *rel = t1->relations;
+    if ((size_t) t2->id >= rel->length) {
+        size_t length = rel->length ? rel->length : 16;
+        while (length <= (size_t) t2->id) length *= 2;
+        rel->memo = realloc(rel->memo, length);
+        memset(rel->memo + rel->length, 0, length - rel->length);
+        rel->length = length;
+    }
+    return &rel->memo[t2->id];
 }
 
 Ang_Type *copy_ang_type(const Ang_Type *src, Ang_Type *dest) {
@@ -65,6 +89,7 @@ static int product_type_equality(const Ang_Type *t1, const Ang_Type *t2) {
         }
 
         if (slot->val.as_int32 != t2_slot_num.as_int32) {
+            destroy_iter_hashtable(&iter);
             return 0;
         }
     }
@@ -83,9 +108,15 @@ int type_equality(const Ang_Type *t1, const Ang_Type *t2) {
     if (t1->id == t2->id) return 1;
     else if (t1->id == ANY_TYPE || t2->id == ANY_TYPE) return 1;
     else if (t1->cat == PRIMITIVE) return 0;
-    else if (t1->cat == SUM) return sum_type_equality(t1, t2);
-    else if (t1->cat == PRODUCT) return product_type_equality(t1, t2);
-    return 0;
+
+    uint8_t known = *relation(t1, t2);
+    if (known & EQUALITY_KNOWN) return (known & EQUAL) != 0;
+    int equal = 0;
+    if (t1->cat == SUM) equal = sum_type_equality(t1, t2);
+    else if (t1->cat == PRODUCT) equal = product_type_equality(t1, t2);
+    // Recursing may have grown the row so look the entry up again
+    *relation(t1, t2) |= EQUALITY_KNOWN | (equal ? EQUAL : 0);
+    return equal;
 }
 
 static int sum_type_structure_equality(const Ang_Type *t1, const Ang_Type *t2) {
@@ -103,21 +134,27 @@ static int sum_type_structure_equality(const Ang_Type *t1, const Ang_Type *t2) {
     return 0;
 }
 
+static int product_type_structure_equality(const Ang_Type *t1, const Ang_Type *t2) {
+    if (t2->cat != PRODUCT) return 0;
+    for (size_t i = 0; i < t1->slot_types->length; i++) {
+        const Ang_Type *slot_t1 = get_ptr(access_list(t1->slot_types, i));
+        const Ang_Type *slot_t2 = get_ptr(access_list(t2->slot_types, i));
+        if (!type_structure_equality(slot_t1, slot_t2)) return 0;
+    }
+    return 1;
+}
+
 int type_structure_equality(const Ang_Type *t1, const Ang_Type *t2)  {
     if (t1->id == t2->id) return 1;
     else if (t1->cat == PRIMITIVE) return 0;
-    else if (t1->cat == SUM) return sum_type_structure_equality(t1, t2);
-    else if (t1->cat == PRODUCT) {
-        if (t2->cat != PRODUCT) return 0;
-        for (size_t i = 0; i < t1->slot_types->length; i++) {
-            const Ang_Type *slot_t1 = get_ptr(access_list(t1->slot_types, i));
-            const Ang_Type *slot_t2 = get_ptr(access_list(t2->slot_types, i));
-            if (!type_structure_equality(slot_t1, slot_t2)) return 0;
-        }
-        return 1;
-    }
-    return 0;
 
+    uint8_t known = *relation(t1, t2);
+    if (known & STRUCTURE_KNOWN) return (known & STRUCTURE_EQUAL) != 0;
+    int equal = 0;
+    if (t1->cat == SUM) equal = sum_type_structure_equality(t1, t2);
+    else if (t1->cat == PRODUCT) equal = product_type_structure_equality(t1, t2);
+    *relation(t1, t2) |= STRUCTURE_KNOWN | (equal ? STRUCTURE_EQUAL : 0);
+    return equal;
 }
 
 void add_slot(Ang_Type *type, const char *sym, const Ang_Type *slot_type) {
@@ -1,317 +1,651 @@
+#define _DEFAULT_SOURCE // clock_gettime isn't part of C99
 #include "ang_vm.h"
 
 #include "error.h"
 #include <stdio.h>
+#include <time.h>
 #include "ang_opcodes.h"
-#include "ang_primitives.h"
+#include "ang_ops.h"
 #include "ang_debug.h"
 #include "lambda.h"
+#include "verifier.h"
 #include <math.h>
 
-void ctor_ang_vm(Ang_VM *vm, size_t gmem_size) {
-    ctor_memory(&vm->mem, gmem_size);
+void ctor_ang_vm(Ang_VM *vm,
+        size_t gmem_size,
+        size_t stack_size,
+        size_t max_stack_size) {
+    ctor_memory(&vm->mem, gmem_size, stack_size, max_stack_size);
     vm->running = 0;
     vm->trace = 0;
     vm->enc_err = 0;
+    vm->budget = 0;
+    vm->time_limit = 0;
+    vm->interrupt = 0;
     vm->compiler.enc_err = &vm->enc_err;
     ctor_compiler(&vm->compiler);
+    ctor_code(&vm->code);
+    ctor_jit(&vm->jit);
 }
 
 void dtor_ang_vm(Ang_VM *vm) {
     dtor_memory(&vm->mem);
     dtor_compiler(&vm->compiler);
+    dtor_code(&vm->code);
+    dtor_jit(&vm->jit);
 }
 
-Value get_next_op(Ang_VM *vm) {
-    return access_list(&INSTR(vm), vm->mem.ip++);
+#ifdef DEBUG
+#define TRACE() \
+    if (vm->trace) { \
+        vm->mem.ip = pc - code; \
+        print_stack_trace(vm); \
+    }
+#else
+#define TRACE()
+#endif
+
+#define UINT_OPERAND() read_uint(&pc)
+#define CONST_OPERAND() consts[read_uint(&pc)]
+
+// Verified code never pops below its frame so it skips the underflow checks
+#define POP() (verified ? pop_unchecked(&vm->mem) : pop_stack(&vm->mem))
+#define POPN(n) \
+    (verified ? (void) (vm->mem.sp -= (n)) : popn_stack(&vm->mem, (n)))
+
+#ifdef ANG_THREADED
+#define CASE(op) op_##op:
+#define NEXT do { TRACE() goto *handlers[*pc++]; } while (0)
+#define DEFINE_HANDLER(op, _) &&op_##op,
+#else
+#define CASE(op) case op:
+#define NEXT goto dispatch
+#endif
+
+void abort_run(Ang_VM *vm) {
+    print_backtrace(vm);
+    vm->mem.sp = 0;
+    vm->mem.fp = 0;
+    vm->mem.num_frames = 0;
+    vm->mem.ip = vm->code.length;
+    vm->running = 0;
+    vm->enc_err = 1;
 }
 
-void eval(Ang_VM *vm) {
-    int op = fetch(vm);
-    if (vm->trace) print_stack_trace(vm);
-    vm->mem.ip++;
-    switch (op) {
-    case HALT:
+void interrupt_vm(Ang_VM *vm) {
+    __atomic_store_n(&vm->interrupt, 1, __ATOMIC_RELAXED);
+}
+
+void add_primitive_types(Ang_VM *vm, Primitive_Types *defaults) {
+    Hashtable *types = &vm->compiler.env.types;
+    set_hashtable(types, "Und", from_ptr(&defaults->und_default));
+    set_hashtable(types, "Any", from_ptr(&defaults->und_default));
+    set_hashtable(types, "Num", from_ptr(&defaults->num_default));
+    set_hashtable(types, "Bool", from_ptr(&defaults->bool_default));
+    set_hashtable(types, "String", from_ptr(&defaults->string_default));
+    set_hashtable(types, "Null", from_ptr(&defaults->null_default));
+}
+
+// Pops the lambda and its argument, failing if it was never assigned
+static Lambda *pop_callee(Ang_VM *vm, Ang_Obj **closure) {
+    vm->mem.registers[A] = pop_stack(&vm->mem);
+    *closure = get_ptr(pop_stack(&vm->mem));
+    if ((*closure)->v.bits == nil_val.bits) {
+        runtime_error(NON_LAMBDA_CALL, "Attempt to call uninitialized lambda\n");
+        abort_run(vm);
+        return 0;
+    }
+    return get_ptr((*closure)->v);
+}
+
+size_t call_lambda(Ang_VM *vm, size_t ret) {
+    Ang_Obj *closure;
+    Lambda *l = pop_callee(vm, &closure);
+    if (!l) return CALL_ABORTED;
+    *push_frame(&vm->mem) = (Call_Frame) { ret, vm->mem.fp, closure, l->ip };
+    vm->mem.fp = vm->mem.sp;
+    if (l->depth >= 0) grow_stack(&vm->mem, vm->mem.fp + l->depth);
+    load_lambda_env(l, &vm->mem);
+    return l->ip;
+}
+
+size_t tail_call_lambda(Ang_VM *vm) {
+    Ang_Obj *closure;
+    Lambda *l = pop_callee(vm, &closure);
+    if (!l) return CALL_ABORTED;
+    // Replace the current frame, keeping its saved fp and return ip
+    Call_Frame *frame = &vm->mem.frames[vm->mem.num_frames - 1];
+    frame->closure = closure;
+    frame->callee = l->ip;
+    vm->mem.sp = vm->mem.fp;
+    if (l->depth >= 0) grow_stack(&vm->mem, vm->mem.fp + l->depth);
+    load_lambda_env(l, &vm->mem);
+    return l->ip;
+}
+
+size_t return_lambda(Ang_VM *vm) {
+    vm->mem.registers[RET_VAL] = pop_stack(&vm->mem);
+    const Call_Frame *frame = &vm->mem.frames[--vm->mem.num_frames];
+    vm->mem.sp = vm->mem.fp;
+    vm->mem.fp = frame->fp;
+    push_stack(&vm->mem, vm->mem.registers[RET_VAL]);
+    return frame->ip;
+}
+
+// Safepoints passed between checks of the limits, to keep them cheap
+#define SAFEPOINT_INTERVAL 1024
+
+typedef struct {
+    size_t budget; // Safepoints the run may still pass
+    double deadline; // Monotonic time to stop at, 0 for none
+    size_t interval; // Safepoints from the last check to the next
+} Run_Limits;
+
+static double monotonic_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t check_interval(const Run_Limits *limits) {
+    // With the budget spent the next safepoint is the one to stop at
+    if (limits->budget == 0) return 1;
+    if (limits->budget < SAFEPOINT_INTERVAL) return limits->budget;
+    return SAFEPOINT_INTERVAL;
+}
+
+// Returns whether the run has to stop, reporting why
+static int exceeded_limits(Ang_VM *vm, Run_Limits *limits) {
+    if (__atomic_load_n(&vm->interrupt, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(&vm->interrupt, 0, __ATOMIC_RELAXED)) {
+        runtime_error(INTERRUPTED, "Run was interrupted\n");
+        return 1;
+    }
+    if (limits->budget < limits->interval) {
+        runtime_error(BUDGET_EXHAUSTED, "Run used up its budget\n");
+        return 1;
+    }
+    limits->budget -= limits->interval;
+    if (limits->deadline && monotonic_time() >= limits->deadline) {
+        runtime_error(DEADLINE_EXCEEDED, "Run went past its time limit\n");
+        return 1;
+    }
+    limits->interval = check_interval(limits);
+    return 0;
+}
+
+// Calls and backward jumps check the limits every so often
+#define SAFEPOINT() \
+    if (--ticks == 0) { \
+        if (exceeded_limits(vm, &limits)) { \
+            abort_run(vm); \
+            return; \
+        } \
+        ticks = limits.interval; \
+    }
+
+// Carries on in f's native code from pc if it has any for it
+#define JIT_RUN(f) \
+    { \
+    const Jit_Function *jit_fn = (f); \
+    const void *target = jit_fn ? jit_address(jit_fn, pc - code) : 0; \
+    if (target) pc = code + jit_run(jit_fn, target, &vm->mem); \
+    }
+
+static void run_vm(void *arg) {
+#ifdef ANG_THREADED
+    static const void *const handlers[] = { OPCODES(DEFINE_HANDLER) };
+#endif
+    Ang_VM *vm = arg;
+    // Types of the unboxed values, for type tests
+    const Ang_Type *null_type = find_type(&vm->compiler, "Null");
+    const Ang_Type *bool_type = find_type(&vm->compiler, "Bool");
+    const Ang_Type *num_type = find_type(&vm->compiler, "Num");
+    const uint8_t *code = vm->code.bytes;
+    const Value *consts = vm->code.consts;
+    const uint8_t *pc = code + vm->mem.ip;
+    const int verified = vm->code.verified == vm->code.length;
+    // Native code relies on the checks verification did
+    Jit *jit = vm->jit.enabled && verified ? &vm->jit : 0;
+    int depth = frame_depth(&vm->code, vm->mem.ip);
+    if (depth >= 0) grow_stack(&vm->mem, vm->mem.sp + depth);
+    Run_Limits limits = { vm->budget ? vm->budget : SIZE_MAX, 0, 0 };
+    if (vm->time_limit > 0) limits.deadline = monotonic_time() + vm->time_limit;
+    limits.interval = check_interval(&limits);
+    size_t ticks = limits.interval;
+    vm->running = 1;
+#ifdef ANG_THREADED
+    NEXT;
+    {
+#else
+dispatch:
+    TRACE()
+    switch (*pc++) {
+#endif
+    CASE(HALT)
+        // Leave ip on the HALT so newly loaded code resumes from here
+        vm->mem.ip = pc - 1 - code;
         vm->running = 0;
-        break;
-    case PUSH:
-        push_num_stack(vm, get_next_op(vm).as_double);
-        break;
-    case PUSOBJ: {
-        Ang_Obj *obj = new_object(&vm->mem, get_ptr(get_next_op(vm)));
-        obj->v = get_next_op(vm);
+        return;
+    CASE(PUSH)
+        push_stack(&vm->mem, CONST_OPERAND());
+        NEXT;
+    CASE(PUSH_INT)
+        push_stack(&vm->mem, from_double(read_int(&pc)));
+        NEXT;
+    CASE(PUSOBJ) {
+        Ang_Obj *obj = new_object(&vm->mem, get_ptr(CONST_OPERAND()));
+        obj->v = CONST_OPERAND();
         push_stack(&vm->mem, from_ptr(obj));
-        break;
-    }
-    case PUSH_0:
-        push_num_stack(vm, 0);
-        break;
-    case POP:
-        pop_stack(&vm->mem);
-        break;
-    case POPN: {
-        int num_local = get_next_op(vm).as_int32;
-        for (int i = 0; i < num_local; i++) {
-            pop_stack(&vm->mem);
-        }
-        break;
-    }
-    case ADD:
-        push_num_stack(vm, pop_int(&vm->mem) + pop_int(&vm->mem));
-        break;
-    case SUB: {
-        int right = pop_int(&vm->mem);
-        int left = pop_int(&vm->mem);
-        push_num_stack(vm, left - right);
-        break;
-    }
-    case MUL:
-        push_num_stack(vm, pop_int(&vm->mem) * pop_int(&vm->mem));
-        break;
-    case DIV: {
-        int right = pop_int(&vm->mem);
-        int left = pop_int(&vm->mem);
-        push_num_stack(vm, left / right);
-        break;
-    }
-    case ADDF:
-        push_num_stack(vm, pop_double(&vm->mem) + pop_double(&vm->mem));
-        break;
-    case SUBF: {
-        double right = pop_double(&vm->mem);
-        double left = pop_double(&vm->mem);
-        push_num_stack(vm, left - right);
-        break;
-    }
-    case MULF:
-        push_num_stack(vm, pop_double(&vm->mem) * pop_double(&vm->mem));
-        break;
-    case DIVF: {
-        double right = pop_double(&vm->mem);
-        double left = pop_double(&vm->mem);
-        push_num_stack(vm, left / right);
-        break;
-    }
-    case LTZ: {
-        double value = pop_double(&vm->mem);
-        Value res = value < 0 ? true_val : false_val;
-        push_stack(&vm->mem, res);
-        break;
+        NEXT;
     }
-    case GTZ: {
-        double value = pop_double(&vm->mem);
-        Value res = value > 0 ? true_val : false_val;
-        push_stack(&vm->mem, res);
-        break;
+    CASE(PUSH_0)
+        push_stack(&vm->mem, from_double(0));
+        NEXT;
+    CASE(POP)
+        POP();
+        NEXT;
+    CASE(POPN)
+        POPN(UINT_OPERAND());
+        NEXT;
+    CASE(ADD) {
+        Value right = POP();
+        Value left = POP();
+        push_stack(&vm->mem, INT_CODE(left, right, +));
+        NEXT;
     }
-    case EQ: {
-        Value res = pop_stack(&vm->mem).bits == pop_stack(&vm->mem).bits
+    CASE(SUB) {
+        Value right = POP();
+        Value left = POP();
+        push_stack(&vm->mem, INT_CODE(left, right, -));
+        NEXT;
+    }
+    CASE(MUL) {
+        Value right = POP();
+        Value left = POP();
+        push_stack(&vm->mem, INT_CODE(left, right, *));
+        NEXT;
+    }
+    CASE(DIV) {
+        int right = int_value(POP());
+        int left = int_value(POP());
+        push_stack(&vm->mem, from_double(left / right));
+        NEXT;
+    }
+    CASE(ADDF)
+        push_stack(&vm->mem, from_double(num_value(POP()) + num_value(POP())));
+        NEXT;
+    CASE(SUBF) {
+        double right = num_value(POP());
+        double left = num_value(POP());
+        push_stack(&vm->mem, from_double(left - right));
+        NEXT;
+    }
+    CASE(MULF)
+        push_stack(&vm->mem, from_double(num_value(POP()) * num_value(POP())));
+        NEXT;
+    CASE(DIVF) {
+        double right = num_value(POP());
+        double left = num_value(POP());
+        push_stack(&vm->mem, from_double(left / right));
+        NEXT;
+    }
+#define CMP_NUM_CODE(op) \
+    { \
+    Value right = POP(); \
+    Value left = POP(); \
+    push_stack(&vm->mem, BOOL_CODE(NUM_CMP(left, right, op))); }
+    CASE(LT)
+        CMP_NUM_CODE(<)
+        NEXT;
+    CASE(LE)
+        CMP_NUM_CODE(<=)
+        NEXT;
+    CASE(GT)
+        CMP_NUM_CODE(>)
+        NEXT;
+    CASE(GE)
+        CMP_NUM_CODE(>=)
+        NEXT;
+    CASE(EQ_NUM)
+        CMP_NUM_CODE(==)
+        NEXT;
+    CASE(NE_NUM)
+        CMP_NUM_CODE(!=)
+        NEXT;
+#undef CMP_NUM_CODE
+    CASE(EQ) {
+        Value res = values_equal(POP(), POP())
             ? true_val
             : false_val;
         push_stack(&vm->mem, res);
-        break;
+        NEXT;
     }
-    case NEG: {
-        Value res = pop_stack(&vm->mem).bits == true_val.bits
+    CASE(NEG) {
+        Value res = POP().bits == true_val.bits
             ? false_val
             : true_val;
         push_stack(&vm->mem, res);
-        break;
+        NEXT;
     }
-#define CMP_CODE(code) \
+#define CMP_CODE(test) \
     {\
-    Value obj1 = pop_stack(&vm->mem);\
+    Value obj1 = POP();\
     const Ang_Type *t1 = 0; \
-    if (is_nil(obj1)) t1 = find_type(&vm->compiler, "Null"); \
-    else if (is_bool(obj1)) t1 = find_type(&vm->compiler, "Bool"); \
-    else if (is_int32(obj1)) t1 = find_type(&vm->compiler, "Num"); \
-    else if (is_double(obj1)) t1 = find_type(&vm->compiler, "Num"); \
+    if (is_nil(obj1)) t1 = null_type; \
+    else if (is_bool(obj1)) t1 = bool_type; \
+    else if (is_int32(obj1)) t1 = num_type; \
+    else if (is_double(obj1)) t1 = num_type; \
     else t1 = ((Ang_Obj *) get_ptr(obj1))->type; \
-    const Ang_Type *t2 = get_ptr(get_next_op(vm)); \
-    Value res = code(t1, t2) \
-        ? true_val \
-        : false_val; \
-    push_stack(&vm->mem, res); }
-    case CMP_TYPE:
+    const Ang_Type *t2 = get_ptr(CONST_OPERAND()); \
+    Inline_Cache *cache = &vm->code.caches[UINT_OPERAND()]; \
+    int res = lookup_cache(cache, t1); \
+    if (res < 0) { \
+        res = test(t1, t2); \
+        update_cache(cache, t1, res); \
+    } \
+    push_stack(&vm->mem, res ? true_val : false_val); }
+    CASE(CMP_TYPE)
         CMP_CODE(type_equality)
-        break;
-    case CMP_STRUCT:
+        NEXT;
+    CASE(CMP_STRUCT)
         CMP_CODE(type_structure_equality)
-        break;
+        NEXT;
 #undef CMP_CODE
-    case JE: {
-        int jmp_loc = get_next_op(vm).as_int32;
-        vm->mem.ip = pop_stack(&vm->mem).bits == true_val.bits
-            ? jmp_loc
-            : vm->mem.ip;
-        break;
-    }
-    case JNE: {
-        int jmp_loc = get_next_op(vm).as_int32;
-        vm->mem.ip = pop_stack(&vm->mem).bits == false_val.bits
-            ? jmp_loc
-            : vm->mem.ip;
-        break;
-    }
-    case GSTORE:
-        vm->mem.gmem[get_next_op(vm).as_int32] = pop_stack(&vm->mem);
-        break;
-    case GLOAD:
-        push_stack(&vm->mem, vm->mem.gmem[get_next_op(vm).as_int32]);
-        break;
-    case STORE:
-        vm->mem.stack[vm->mem.fp + get_next_op(vm).as_int32] = pop_stack(&vm->mem);
-        break;
-    case LOAD:
-        push_stack(&vm->mem, vm->mem.stack[vm->mem.fp + get_next_op(vm).as_int32]);
-        break;
-    case STORET:
-        vm->mem.registers[RET_VAL] = pop_stack(&vm->mem);
-        break;
-    case PUSRET:
+#define QUICK_CMP_CODE(quick) \
+    {\
+    Value v = POP();\
+    const Ang_Type *t2 = get_ptr(CONST_OPERAND()); \
+    push_stack(&vm->mem, BOOL_CODE(quick_cmp_type(quick, v, t2))); }
+    CASE(CMP_NUM)
+        QUICK_CMP_CODE(CMP_NUM)
+        NEXT;
+    CASE(CMP_BOOL)
+        QUICK_CMP_CODE(CMP_BOOL)
+        NEXT;
+    CASE(CMP_NULL)
+        QUICK_CMP_CODE(CMP_NULL)
+        NEXT;
+    CASE(CMP_STRING)
+        QUICK_CMP_CODE(CMP_STRING)
+        NEXT;
+#undef QUICK_CMP_CODE
+    CASE(JE) {
+        int jmp_loc = UINT_OPERAND();
+        if (POP().bits == true_val.bits) {
+            if (code + jmp_loc < pc) SAFEPOINT()
+            pc = code + jmp_loc;
+        }
+        NEXT;
+    }
+    CASE(JNE) {
+        int jmp_loc = UINT_OPERAND();
+        if (POP().bits == false_val.bits) {
+            if (code + jmp_loc < pc) SAFEPOINT()
+            pc = code + jmp_loc;
+        }
+        NEXT;
+    }
+    CASE(GSTORE)
+        vm->mem.gmem[UINT_OPERAND()] = POP();
+        NEXT;
+    CASE(GLOAD)
+        push_stack(&vm->mem, vm->mem.gmem[UINT_OPERAND()]);
+        NEXT;
+    CASE(STORE)
+        vm->mem.stack[vm->mem.fp + UINT_OPERAND()] = POP();
+        NEXT;
+    CASE(LOAD)
+        push_stack(&vm->mem, vm->mem.stack[vm->mem.fp + UINT_OPERAND()]);
+        NEXT;
+    CASE(STORET)
+        vm->mem.registers[RET_VAL] = POP();
+        NEXT;
+    CASE(PUSRET)
         push_stack(&vm->mem, vm->mem.registers[RET_VAL]);
-        break;
-    case CONS_TUPLE: {
-        Ang_Obj *obj = new_object(&vm->mem, get_ptr(get_next_op(vm)));
-        List *tuple_vals = malloc(sizeof(List));
+        NEXT;
+    CASE(MAKE_TUPLE) {
+        Ang_Obj *obj = new_object(&vm->mem, get_ptr(CONST_OPERAND()));
+        int num_slots = UINT_OPERAND();
+        List *tuple_vals = mem_alloc(&vm->mem, sizeof(List));
         ctor_list(tuple_vals);
-        int num_slots = get_next_op(vm).as_int32;
+        // The first slot is on top
         for (int i = 0; i < num_slots; i++) {
-            append_list(tuple_vals, nil_val);
+            append_list(tuple_vals, POP());
         }
         obj->v = from_ptr(tuple_vals);
         push_stack(&vm->mem, from_ptr(obj));
-        break;
-    }
-    case SET_TUPLE: {
-        Value v = pop_stack(&vm->mem);
-        Ang_Obj *tup = get_ptr(pop_stack(&vm->mem));
-        List *vals = get_ptr(tup->v);
-        set_list(vals, get_next_op(vm).as_int32, v);
-        push_stack(&vm->mem, from_ptr(tup));
-        break;
-    }
-    case LOAD_TUPLE: {
-        int slot_num = pop_int(&vm->mem);
-        Ang_Obj *tuple = get_ptr(pop_stack(&vm->mem));
+        NEXT;
+    }
+    CASE(UNPACK_TUPLE) {
+        List *vals = get_ptr(((Ang_Obj *) get_ptr(POP()))->v);
+        int num_slots = UINT_OPERAND();
+        for (int i = 0; i < num_slots; i++) {
+            push_stack(&vm->mem, access_list(vals, i));
+        }
+        NEXT;
+    }
+    CASE(LOAD_TUPLE) {
+        int slot_num = int_value(POP());
+        Ang_Obj *tuple = get_ptr(POP());
         Ang_Obj *obj = get_ptr(access_list(get_ptr(tuple->v), slot_num));
         push_stack(&vm->mem, from_ptr(obj));
-        break;
+        NEXT;
     }
-    case CONS_ARR: {
-        Ang_Obj *obj = new_object(&vm->mem, get_ptr(get_next_op(vm)));
-        int num_ele = get_next_op(vm).as_int32;
-        List *l = malloc(sizeof(List));
+    CASE(CONS_ARR) {
+        Ang_Obj *obj = new_object(&vm->mem, get_ptr(CONST_OPERAND()));
+        int num_ele = UINT_OPERAND();
+        List *l = mem_alloc(&vm->mem, sizeof(List));
         ctor_list(l);
         for (int i = 0; i < num_ele; i++) {
-            append_list(l, pop_stack(&vm->mem));
+            append_list(l, POP());
         }
         obj->v = from_ptr(l);
         push_stack(&vm->mem, from_ptr(obj));
-        break;
+        NEXT;
     }
-    case ACCESS_ARR: {
-        Ang_Obj *arr_obj = get_ptr(pop_stack(&vm->mem));
-        Value index = pop_stack(&vm->mem);
+    CASE(ACCESS_ARR) {
+        Ang_Obj *arr_obj = get_ptr(POP());
+        Value index = POP();
         List *arr = get_ptr(arr_obj->v);
         if (!is_int32(index) || index.as_int32 >= arr->length) {
             push_stack(&vm->mem, nil_val);
+        } else {
+            push_stack(&vm->mem, access_list(arr, index.as_int32));
         }
-        push_stack(&vm->mem, access_list(arr, index.as_int32));
-        break;
+        NEXT;
     }
-    case SET_ARR: {
-        Ang_Obj *arr_obj = get_ptr(pop_stack(&vm->mem));
-        Value index = pop_stack(&vm->mem);
-        Ang_Obj *rhs = get_ptr(pop_stack(&vm->mem));
+    CASE(SET_ARR) {
+        Ang_Obj *arr_obj = get_ptr(POP());
+        Value index = POP();
+        Ang_Obj *rhs = get_ptr(POP());
         List *arr = get_ptr(arr_obj->v);
         if (!is_int32(index) || index.as_int32 >= arr->length) {
             runtime_error(ARR_OUT_OF_BOUNDS,
                 "Attempted to assign out of array bounds.\n");
         }
         set_list(arr, index.as_int32, from_ptr(rhs));
+        write_barrier(&vm->mem, arr_obj, from_ptr(rhs));
         push_stack(&vm->mem, from_ptr(arr_obj));
-        break;
+        NEXT;
     }
-    case CONS_LAMBDA: {
-        Ang_Obj *obj = new_object(&vm->mem, get_ptr(get_next_op(vm)));
-        Lambda *l = malloc(sizeof(Lambda));
-        l->ip = get_next_op(vm).as_int32;
-        save_lambda_env(l, &vm->mem);
+    CASE(CONS_LAMBDA) {
+        Ang_Obj *obj = new_object(&vm->mem, get_ptr(CONST_OPERAND()));
+        Lambda *l = mem_alloc(&vm->mem, sizeof(Lambda));
+        l->ip = UINT_OPERAND();
+        save_lambda_env(l, &vm->mem, UINT_OPERAND());
+        l->depth = frame_depth(&vm->code, l->ip);
         obj->v = from_ptr(l);
         push_stack(&vm->mem, from_ptr(obj));
-        break;
+        NEXT;
     }
-    case SET_FP:
+    CASE(SET_FP)
         vm->mem.fp = vm->mem.sp;
-        break;
-    case RESET_FP:
+        NEXT;
+    CASE(RESET_FP)
         vm->mem.fp = 0;
-        break;
-    case DUP:
+        NEXT;
+    CASE(DUP)
         push_stack(&vm->mem, vm->mem.stack[vm->mem.sp - 1]);
-        break;
-    case SET_DEFAULT_VAL: {
-        const char *type_name = get_ptr(get_next_op(vm));
-        find_type(&vm->compiler, type_name)->default_value = pop_stack(&vm->mem);
-        break;
-    }
-    case LOAD_DEFAULT_VAL: {
-        Ang_Type *type = get_ptr(get_next_op(vm));
+        NEXT;
+    CASE(SET_DEFAULT_VAL) {
+        const uint8_t *operand = pc;
+        const char *type_name = get_ptr(CONST_OPERAND());
+        Ang_Type *type = find_type(&vm->compiler, type_name);
+        type->default_value = POP();
+        add_root(&vm->mem, &type->default_value);
+        // Remember the type so running this again skips the lookup and rooting
+        uint32_t i = add_const(&vm->code, from_ptr(type));
+        consts = vm->code.consts;
+        uint8_t *at = vm->code.bytes + (operand - code);
+        if (patch_uint(at, pc - operand, i)) at[-1] = SET_DEFAULT_VAL_RESOLVED;
+        NEXT;
+    }
+    CASE(SET_DEFAULT_VAL_RESOLVED) {
+        Ang_Type *type = get_ptr(CONST_OPERAND());
+        type->default_value = POP();
+        NEXT;
+    }
+    CASE(LOAD_DEFAULT_VAL) {
+        Ang_Type *type = get_ptr(CONST_OPERAND());
         push_stack(&vm->mem, type->default_value);
-        break;
-    }
-    case STO_REG:
-        vm->mem.registers[get_next_op(vm).as_int32] = pop_stack(&vm->mem);
-        break;
-    case LOAD_REG:
-        push_stack(&vm->mem, vm->mem.registers[get_next_op(vm).as_int32]);
-        break;
-    case SWAP_REG: {
-        int reg1 = get_next_op(vm).as_int32;
-        int reg2 = get_next_op(vm).as_int32;
+        NEXT;
+    }
+    CASE(STO_REG)
+        vm->mem.registers[UINT_OPERAND()] = POP();
+        NEXT;
+    CASE(LOAD_REG)
+        push_stack(&vm->mem, vm->mem.registers[UINT_OPERAND()]);
+        NEXT;
+    CASE(SWAP_REG) {
+        int reg1 = UINT_OPERAND();
+        int reg2 = UINT_OPERAND();
         Value tmp = vm->mem.registers[reg1];
         vm->mem.registers[reg1] = vm->mem.registers[reg2];
         vm->mem.registers[reg2] = tmp;
-        break;
+        NEXT;
     }
-    case MOV_REG: {
-        int reg1 = get_next_op(vm).as_int32;
-        int reg2 = get_next_op(vm).as_int32;
+    CASE(MOV_REG) {
+        int reg1 = UINT_OPERAND();
+        int reg2 = UINT_OPERAND();
         vm->mem.registers[reg2] = vm->mem.registers[reg1];
-        break;
-    }
-    case JMP:
-        vm->mem.ip = get_next_op(vm).as_int32;
-        break;
-    case CALL: {
-        vm->mem.registers[A] = pop_stack(&vm->mem);
-        Value l_val = ((Ang_Obj *) get_ptr(pop_stack(&vm->mem)))->v;
-        if (l_val.bits == nil_val.bits) {
-            runtime_error(NON_LAMBDA_CALL, "Attempt to call uninitialized lambda\n");
-            return;
+        NEXT;
+    }
+    CASE(JMP) {
+        int jmp_loc = UINT_OPERAND();
+        if (code + jmp_loc < pc) SAFEPOINT()
+        pc = code + jmp_loc;
+        NEXT;
+    }
+    CASE(CALL) {
+        SAFEPOINT()
+        size_t entry = call_lambda(vm, pc - code);
+        if (entry == CALL_ABORTED) return;
+        pc = code + entry;
+        if (jit) JIT_RUN(jit_call(jit, &vm->code, entry))
+        NEXT;
+    }
+    CASE(TAIL_CALL) {
+        SAFEPOINT()
+        size_t entry = tail_call_lambda(vm);
+        if (entry == CALL_ABORTED) return;
+        pc = code + entry;
+        if (jit) JIT_RUN(jit_call(jit, &vm->code, entry))
+        NEXT;
+    }
+    CASE(RET) {
+        pc = code + return_lambda(vm);
+        if (jit && vm->mem.num_frames) {
+            JIT_RUN(jit_find(jit, vm->mem.frames[vm->mem.num_frames - 1].callee))
         }
-        Lambda *l = get_ptr(l_val);
-        int ip = l->ip;
-        push_num_stack(vm, vm->mem.fp);
-        push_num_stack(vm, vm->mem.ip);
-        vm->mem.fp = vm->mem.sp;
-        load_lambda_env(l, &vm->mem);
-        vm->mem.ip = ip;
-        break;
-    }
-    case RET:
-        vm->mem.registers[RET_VAL] = pop_stack(&vm->mem);
-        vm->mem.sp = vm->mem.fp;
-        vm->mem.ip = pop_stack(&vm->mem).as_int32;
-        vm->mem.fp = pop_stack(&vm->mem).as_int32;
-        push_stack(&vm->mem, vm->mem.registers[RET_VAL]);
-        break;
+        NEXT;
+    }
+    CASE(POPN_KEEP) {
+        Value top = POP();
+        POPN(UINT_OPERAND());
+        push_stack(&vm->mem, top);
+        NEXT;
+    }
+    CASE(LOAD_SLOT) {
+        Ang_Obj *tuple = get_ptr(POP());
+        push_stack(&vm->mem, access_list(get_ptr(tuple->v), UINT_OPERAND()));
+        NEXT;
+    }
+/* Operands are decoded before either is read so that when both live on the
+ * stack the right one, which is on top, gets popped first.
+ */
+#define REG_CODE(expr) \
+    { \
+    uint32_t dest = UINT_OPERAND(); \
+    uint32_t lhs = UINT_OPERAND(); \
+    uint32_t rhs = UINT_OPERAND(); \
+    Value right = read_reg_operand(&vm->mem, rhs); \
+    Value left = read_reg_operand(&vm->mem, lhs); \
+    write_reg_operand(&vm->mem, dest, expr); }
+    CASE(ADD_R)
+        REG_CODE(INT_CODE(left, right, +))
+        NEXT;
+    CASE(SUB_R)
+        REG_CODE(INT_CODE(left, right, -))
+        NEXT;
+    CASE(MUL_R)
+        REG_CODE(INT_CODE(left, right, *))
+        NEXT;
+    CASE(ADDF_R)
+        REG_CODE(NUM_CODE(left, right, +))
+        NEXT;
+    CASE(SUBF_R)
+        REG_CODE(NUM_CODE(left, right, -))
+        NEXT;
+    CASE(MULF_R)
+        REG_CODE(NUM_CODE(left, right, *))
+        NEXT;
+    CASE(DIVF_R)
+        REG_CODE(NUM_CODE(left, right, /))
+        NEXT;
+    CASE(LT_R)
+        REG_CODE(BOOL_CODE(NUM_CMP(left, right, <)))
+        NEXT;
+    CASE(LE_R)
+        REG_CODE(BOOL_CODE(NUM_CMP(left, right, <=)))
+        NEXT;
+    CASE(GT_R)
+        REG_CODE(BOOL_CODE(NUM_CMP(left, right, >)))
+        NEXT;
+    CASE(GE_R)
+        REG_CODE(BOOL_CODE(NUM_CMP(left, right, >=)))
+        NEXT;
+    // Also matches literals against values that may not be numbers
+    CASE(EQ_R)
+        REG_CODE(BOOL_CODE(values_equal(left, right)))
+        NEXT;
+    CASE(NE_R)
+        REG_CODE(BOOL_CODE(!values_equal(left, right)))
+        NEXT;
+#undef REG_CODE
+    }
+}
+
+#undef TRACE
+#undef SAFEPOINT
+#undef JIT_RUN
+#undef UINT_OPERAND
+#undef CONST_OPERAND
+#undef POP
+#undef POPN
+#undef CASE
+#undef NEXT
+#undef DEFINE_HANDLER
+
+void eval(Ang_VM *vm) {
+    if (!run_stack_guarded(&vm->mem, run_vm, vm)) {
+        runtime_error(STACK_OVERFLOW, "Stack overflow\n");
+        abort_run(vm);
     }
 }
 
 int fetch(const Ang_VM *vm) {
-    return access_list(&INSTR(vm), vm->mem.ip).as_int32;
+    return vm->code.bytes[vm->mem.ip];
 }
 
 int emit_op(Ang_VM *vm, Value op) {
@@ -323,17 +657,30 @@ void push_num_stack(Ang_VM *vm, double num) {
     push_stack(&vm->mem, from_double(num));
 }
 
+// Loads the new instructions, which run unchecked if they verify
+static void load_instructions(Ang_VM *vm) {
+    size_t start = vm->code.length;
+    load_code(&vm->code, &INSTR(vm));
+    verify_code(&vm->code, start);
+}
+
 void run_compiled_instructions(Ang_VM *vm, Compiler *c) {
-    int last_op = 0;
     for (size_t i = 0; i < c->instr.length; i++) {
-        last_op = emit_op(vm, access_list(&c->instr, i));
+        emit_op(vm, access_list(&c->instr, i));
     }
-    while (vm->mem.ip < last_op) eval(vm);
+    load_instructions(vm);
+    eval(vm);
 }
 
-void run_code(Ang_VM *vm, const char *code, const char *src_name) {
+void load_script(Ang_VM *vm, const char *code, const char *src_name) {
     compile_code(&vm->compiler, code, src_name);
     if (vm->enc_err) return;
     vm->mem.global_size = vm->compiler.env.symbols.size;
-    while (vm->mem.ip < INSTR(vm).length) eval(vm);
+    load_instructions(vm);
+}
+
+void run_code(Ang_VM *vm, const char *code, const char *src_name) {
+    load_script(vm, code, src_name);
+    if (vm->enc_err) return;
+    eval(vm);
 }
@@ -0,0 +1,92 @@
+#include "aot.h"
+
+#include "error.h"
+#include "ang_primitives.h"
+#include "lambda.h"
+
+void aot_pusobj(Ang_VM *vm, Value type, Value v) {
+    Ang_Obj *obj = new_object(&vm->mem, get_ptr(type));
+    obj->v = v;
+    push_stack(&vm->mem, from_ptr(obj));
+}
+
+void aot_make_tuple(Ang_VM *vm, Value type, int num_slots) {
+    Ang_Obj *obj = new_object(&vm->mem, get_ptr(type));
+    List *tuple_vals = mem_alloc(&vm->mem, sizeof(List));
+    ctor_list(tuple_vals);
+    // The first slot is on top
+    for (int i = 0; i < num_slots; i++) {
+        append_list(tuple_vals, pop_unchecked(&vm->mem));
+    }
+    obj->v = from_ptr(tuple_vals);
+    push_stack(&vm->mem, from_ptr(obj));
+}
+
+void aot_cons_arr(Ang_VM *vm, Value type, int num_ele) {
+    Ang_Obj *obj = new_object(&vm->mem, get_ptr(type));
+    List *l = mem_alloc(&vm->mem, sizeof(List));
+    ctor_list(l);
+    for (int i = 0; i < num_ele; i++) {
+        append_list(l, pop_unchecked(&vm->mem));
+    }
+    obj->v = from_ptr(l);
+    push_stack(&vm->mem, from_ptr(obj));
+}
+
+void aot_cons_lambda(Ang_VM *vm, Value type, size_t ip, int nenv) {
+    Ang_Obj *obj = new_object(&vm->mem, get_ptr(type));
+    Lambda *l = mem_alloc(&vm->mem, sizeof(Lambda));
+    l->ip = ip;
+    save_lambda_env(l, &vm->mem, nenv);
+    l->depth = frame_depth(&vm->code, l->ip);
+    obj->v = from_ptr(l);
+    push_stack(&vm->mem, from_ptr(obj));
+}
+
+int aot_cmp_type(Ang_VM *vm, Value v, Value t2, size_t cache, int structural) {
+    const Ang_Type *t1;
+    if (is_nil(v)) t1 = find_type(&vm->compiler, "Null");
+    else if (is_bool(v)) t1 = find_type(&vm->compiler, "Bool");
+    else if (is_int32(v) || is_double(v)) t1 = find_type(&vm->compiler, "Num");
+    else t1 = ((Ang_Obj *) get_ptr(v))->type;
+    Inline_Cache *c = &vm->code.caches[cache];
+    int res = lookup_cache(c, t1);
+    if (res < 0) {
+        res = structural
+            ? type_structure_equality(t1, get_ptr(t2))
+            : type_equality(t1, get_ptr(t2));
+        update_cache(c, t1, res);
+    }
+    return res;
+}
+
+int run_compiled(const char *source,
+        const char *src_name,
+        int reg_vm,
+        size_t length,
+        uint32_t checksum,
+        void (*run)(void *vm)) {
+    Ang_VM vm;
+    ctor_ang_vm(&vm, 100, DEFAULT_STACK_SIZE, DEFAULT_MAX_STACK_SIZE);
+    vm.compiler.reg_vm = reg_vm;
+    Primitive_Types defaults;
+    ctor_primitive_types(&defaults);
+    add_primitive_types(&vm, &defaults);
+
+    load_script(&vm, source, src_name);
+    if (!vm.enc_err
+            && (vm.code.length != length || code_checksum(&vm.code) != checksum)) {
+        runtime_error(STALE_PROGRAM,
+            "Program doesn't match the code it was compiled from\n");
+        vm.enc_err = 1;
+    }
+    if (!vm.enc_err && !run_stack_guarded(&vm.mem, run, &vm)) {
+        runtime_error(STACK_OVERFLOW, "Stack overflow\n");
+        abort_run(&vm);
+    }
+    int status = vm.enc_err;
+
+    dtor_ang_vm(&vm);
+    dtor_primitive_types(&defaults);
+    return status;
+}
@@ -6,7 +6,9 @@
 #include "ang_primitives.h"
 #include "utility.h"
 #include "ang_mem.h"
+#include "ang_ops.h"
 #include "parser.h"
+#include "peephole.h"
 
 void ctor_compiler(Compiler *compiler) {
     ctor_list(&compiler->instr);
@@ -14,6 +16,11 @@ void ctor_compiler(Compiler *compiler) {
     compiler->parent = 0;
     ctor_list(&compiler->compiled_ast);
     ctor_list(&compiler->jmp_locs);
+    compiler->reg_vm = 0;
+    compiler->num_temps = 0;
+    compiler->closure = 0;
+    compiler->num_caches = 0;
+    compiler->num_type_ids = PRIMITIVE_COUNT;
 }
 
 void dtor_compiler(Compiler *compiler) {
@@ -42,17 +49,38 @@ void compile_code(Compiler *c, const char *code, const char *src_name) {
     #ifdef DEBUG
     print_ast(ast, 0);
     #endif
+    size_t start = c->instr.length;
     compile(c, ast);
+    if (!*c->enc_err) optimize_instr(&c->instr, start);
     dtor_parser(&parser);
 }
 
+/* Compiles an expression whose value nothing uses. Declarations and
+ * assignments then push nothing, anything else has its value popped.
+ */
+static void compile_statement(Compiler *c, Ast *code) {
+    switch (code->type) {
+    case AST_VAR_DECL:
+    case AST_VAL_DECL:
+    case AST_DESTR_DECL:
+    case AST_TYPE_DECL:
+    case AST_ASSIGN:
+        code->discarded = 1;
+        compile(c, code);
+        break;
+    default:
+        compile(c, code);
+        append_list(&c->instr, from_double(POP));
+        break;
+    }
+}
+
 void compile(Compiler *c, Ast *code) {
     switch (code->type) {
     case AST_PROG:
         for (int i = 0; i < code->num_children; i++) {
-            compile(c, get_child(code, i));
-            if (i + 1 != code->num_children)
-                append_list(&c->instr, from_double(POP));
+            if (i + 1 != code->num_children) compile_statement(c, get_child(code, i));
+            else compile(c, get_child(code, i));
         }
         break;
     case AST_ADD_OP:
@@ -132,13 +160,144 @@ void compile(Compiler *c, Ast *code) {
     }
 }
 
+// Whether evaluating code can't change what a variable holds
+static int is_pure(const Ast *code) {
+    switch (code->type) {
+    case AST_LITERAL:
+        return code->num_children == 0;
+    case AST_VARIABLE:
+        return 1;
+    case AST_ADD_OP:
+    case AST_MUL_OP:
+    case AST_COMP_OP:
+    case AST_UNARY_OP:
+        for (int i = 0; i < code->num_children; i++) {
+            if (!is_pure(get_child(code, i))) return 0;
+        }
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int is_reg_imm(const Ast *code) {
+    if (code->type != AST_LITERAL || code->assoc_token->type != TOKEN_NUM) return 0;
+    Value literal = code->assoc_token->literal;
+    return is_int32(literal)
+        && literal.as_int32 > -MAX_REG_IMM
+        && literal.as_int32 < MAX_REG_IMM;
+}
+
+static int is_reg_op(const Ast *code) {
+    return code->type == AST_ADD_OP
+        || code->type == AST_MUL_OP
+        || code->type == AST_COMP_OP
+        || (code->type == AST_UNARY_OP && code->assoc_token->type == TOKEN_MINUS);
+}
+
+// Whether the register instructions computing code push nothing
+static int in_registers(const Compiler *c, const Ast *code) {
+    if (is_reg_imm(code)) return 1;
+    if (code->type == AST_VARIABLE) {
+        return find_symbol(c, code->assoc_token->lexeme) != 0;
+    }
+    if (!is_reg_op(code)) return 0;
+    for (int i = 0; i < code->num_children; i++) {
+        if (!in_registers(c, get_child(code, i))) return 0;
+    }
+    return 1;
+}
+
+/* Points the register instruction that computed value at dest instead of
+ * the stack. Returns whether value was computed by one.
+ */
+static int retarget_reg_op(Compiler *c, const Ast *value, uint32_t dest) {
+    if (!c->reg_vm || !is_reg_op(value)) return 0;
+    set_list(&c->instr, c->instr.length - 3, from_double(dest));
+    return 1;
+}
+
+/* Returns the register operand the value of code is read through. Small
+ * integer literals become immediates and, if direct is set, variables are
+ * named by their slot. If temp is set, register instructions leave their
+ * result in a temporary. Anything else is compiled onto the stack.
+ */
+static uint32_t compile_reg_operand(Compiler *c, Ast *code, int direct, int temp) {
+    if (is_reg_imm(code)) {
+        code->eval_type = find_type(c, "Num");
+        code->known_int = 1;
+        int32_t n = code->assoc_token->literal.as_int32;
+        return REG_OPERAND(REG_IMM, ((uint32_t) n << 1) ^ (uint32_t) (n >> 31));
+    } else if (direct && code->type == AST_VARIABLE) {
+        const Symbol *sym = find_symbol(c, code->assoc_token->lexeme);
+        if (sym) {
+            code->eval_type = sym->type;
+            code->known_int = sym->known_int;
+            return REG_OPERAND(sym->global ? REG_GLOBAL : REG_LOCAL, sym->loc);
+        }
+    }
+    compile(c, code);
+    if (*c->enc_err) return REG_OPERAND(REG_STACK, 0);
+    if (temp && retarget_reg_op(c, code, REG_OPERAND(REG_TEMP, c->num_temps))) {
+        return REG_OPERAND(REG_TEMP, c->num_temps++);
+    }
+    return REG_OPERAND(REG_STACK, 0);
+}
+
+/* The left operand is only read directly when the right one can't assign to
+ * it, since it is read after the right one is evaluated. For the same reason
+ * it is only left in a temporary when the right one pushes nothing over it.
+ * Both temporaries are free again once the instruction using them has run.
+ */
+static void compile_reg_operands(Compiler *c, Ast *lhs, Ast *rhs, uint32_t operands[2]) {
+    int num_temps = c->num_temps;
+    operands[0] = compile_reg_operand(c, lhs, is_pure(rhs), in_registers(c, rhs));
+    operands[1] = compile_reg_operand(c, rhs, 1, 1);
+    c->num_temps = num_temps;
+}
+
+static void emit_reg_op(Compiler *c, Opcode op, uint32_t dest, const uint32_t operands[2]) {
+    append_list(&c->instr, from_double(op));
+    append_list(&c->instr, from_double(dest));
+    append_list(&c->instr, from_double(operands[0]));
+    append_list(&c->instr, from_double(operands[1]));
+}
+
+static Opcode reg_opcode(TokenType type, int known_int) {
+    switch (type) {
+    case TOKEN_PLUS: return known_int ? ADD_R : ADDF_R;
+    case TOKEN_MINUS: return known_int ? SUB_R : SUBF_R;
+    case TOKEN_STAR: return known_int ? MUL_R : MULF_R;
+    case TOKEN_SLASH: return DIVF_R;
+    case TOKEN_EQ_EQ: return EQ_R;
+    case TOKEN_NEQ: return NE_R;
+    case TOKEN_GT: return GT_R;
+    case TOKEN_GTE: return GE_R;
+    case TOKEN_LT: return LT_R;
+    default: return LE_R;
+    }
+}
+
 void compile_unary_op(Compiler *c, Ast *code) {
     switch (code->assoc_token->type) {
     case TOKEN_MINUS:
         code->eval_type = find_type(c, "Num");
-        append_list(&c->instr, from_double(PUSH_0));
-        compile(c, get_child(code, 0));
-        append_list(&c->instr, from_double(SUBF));
+        if (c->reg_vm) {
+            int num_temps = c->num_temps;
+            uint32_t operands[2] = {
+                REG_OPERAND(REG_IMM, 0),
+                compile_reg_operand(c, get_child(code, 0), 1, 1)
+            };
+            c->num_temps = num_temps;
+            code->known_int = get_child(code, 0)->known_int;
+            emit_reg_op(c, code->known_int ? SUB_R : SUBF_R,
+                REG_OPERAND(REG_STACK, 0), operands);
+        } else {
+            append_list(&c->instr, from_double(PUSH_0));
+            compile(c, get_child(code, 0));
+            code->known_int = get_child(code, 0)->known_int;
+            append_list(&c->instr, from_double(code->known_int ? SUB : SUBF));
+        }
         if (get_child(code, 0)->eval_type->id != NUM_TYPE) {
             error(code->assoc_token->line,
                     TYPE_ERROR,
@@ -166,8 +325,13 @@ void compile_binary_op(Compiler *c, Ast *code) {
     Ast *lhs = get_child(code, 1);
     Ast *rhs = get_child(code, 0);
 
-    compile(c, lhs);
-    compile(c, rhs);
+    uint32_t operands[2];
+    if (c->reg_vm) {
+        compile_reg_operands(c, lhs, rhs, operands);
+    } else {
+        compile(c, lhs);
+        compile(c, rhs);
+    }
 
     code->eval_type = find_type(c, "Num");
     if (lhs->eval_type->id != NUM_TYPE || rhs->eval_type->id != NUM_TYPE) {
@@ -178,15 +342,25 @@ void compile_binary_op(Compiler *c, Ast *code) {
         return;
     }
 
+    // Integers aren't closed under division so it always goes through doubles
+    code->known_int = lhs->known_int && rhs->known_int
+        && code->assoc_token->type != TOKEN_SLASH;
+
+    if (c->reg_vm) {
+        emit_reg_op(c, reg_opcode(code->assoc_token->type, code->known_int),
+            REG_OPERAND(REG_STACK, 0), operands);
+        return;
+    }
+
     switch (code->assoc_token->type) {
     case TOKEN_PLUS:
-        append_list(&c->instr, from_double(ADDF));
+        append_list(&c->instr, from_double(code->known_int ? ADD : ADDF));
         break;
     case TOKEN_MINUS:
-        append_list(&c->instr, from_double(SUBF));
+        append_list(&c->instr, from_double(code->known_int ? SUB : SUBF));
         break;
     case TOKEN_STAR:
-        append_list(&c->instr, from_double(MULF));
+        append_list(&c->instr, from_double(code->known_int ? MUL : MULF));
         break;
     case TOKEN_SLASH:
         append_list(&c->instr, from_double(DIVF));
@@ -200,8 +374,13 @@ void compile_comp_op(Compiler *c, Ast *code) {
     Ast *lhs = get_child(code, 1);
     Ast *rhs = get_child(code, 0);
 
-    compile(c, lhs);
-    compile(c, rhs);
+    uint32_t operands[2];
+    if (c->reg_vm) {
+        compile_reg_operands(c, lhs, rhs, operands);
+    } else {
+        compile(c, lhs);
+        compile(c, rhs);
+    }
 
     code->eval_type = find_type(c, "Bool");
     if (lhs->eval_type->id != NUM_TYPE || rhs->eval_type->id != NUM_TYPE) {
@@ -212,91 +391,96 @@ void compile_comp_op(Compiler *c, Ast *code) {
         return;
     }
 
+    if (c->reg_vm) {
+        emit_reg_op(c, reg_opcode(code->assoc_token->type, 0),
+            REG_OPERAND(REG_STACK, 0), operands);
+        return;
+    }
+
     switch (code->assoc_token->type) {
     case TOKEN_EQ_EQ:
-        append_list(&c->instr, from_double(EQ));
+        append_list(&c->instr, from_double(EQ_NUM));
         break;
     case TOKEN_NEQ:
-        append_list(&c->instr, from_double(EQ));
-        append_list(&c->instr, from_double(NEG));
+        append_list(&c->instr, from_double(NE_NUM));
         break;
     case TOKEN_GT:
-        append_list(&c->instr, from_double(SUBF));
-        append_list(&c->instr, from_double(GTZ));
+        append_list(&c->instr, from_double(GT));
         break;
     case TOKEN_GTE:
-        append_list(&c->instr, from_double(SUBF));
-        append_list(&c->instr, from_double(LTZ));
-        append_list(&c->instr, from_double(NEG));
+        append_list(&c->instr, from_double(GE));
         break;
     case TOKEN_LT:
-        append_list(&c->instr, from_double(SUBF));
-        append_list(&c->instr, from_double(LTZ));
+        append_list(&c->instr, from_double(LT));
         break;
     case TOKEN_LTE:
-        append_list(&c->instr, from_double(SUBF));
-        append_list(&c->instr, from_double(GTZ));
-        append_list(&c->instr, from_double(NEG));
+        append_list(&c->instr, from_double(LE));
         break;
     default:
         break;
     }
 }
 
-void compile_bool_op(Compiler *c, Ast *code) {
-    code->eval_type = find_type(c, "Bool");
-    Ast *lhs = get_child(code, 1);
-    compile(c, lhs);
-    if (code->assoc_token->type == TOKEN_AND) {
-        append_list(&c->instr, from_double(JNE));
-    } else {
-        append_list(&c->instr, from_double(JE));
-    }
-    int jmp_loc = instr_count(c);
-    append_list(&c->instr, from_double(0));
-
-    Ast *rhs = get_child(code, 0);
-    compile(c, rhs);
-    if (code->assoc_token->type == TOKEN_AND) {
-        append_list(&c->instr, from_double(JNE));
-    } else {
-        append_list(&c->instr, from_double(JE));
+// Points the jumps whose operands are at the instruction indices in jumps here
+static void patch_jumps(Compiler *c, const List *jumps) {
+    for (size_t i = 0; i < jumps->length; i++) {
+        set_list(&c->instr,
+            access_list(jumps, i).as_int32,
+            from_double(instr_count(c)));
     }
-    int rhs_jmp_loc = instr_count(c);
-    append_list(&c->instr, from_double(0));
+}
 
-    // Push value if both pass
-    append_list(&c->instr, from_double(PUSOBJ));
-    append_list(&c->instr, from_ptr((void *) code->eval_type));
-    if (code->assoc_token->type == TOKEN_AND) {
-        append_list(&c->instr, true_val);
-    } else {
-        append_list(&c->instr, false_val);
+/* Compiles cond so that it jumps when it evaluates to sense and falls
+ * through otherwise, adding the jumps to patch to jumps. Boolean operators
+ * become chains of jumps rather than pushing their intermediate results.
+ */
+static void compile_cond_jump(Compiler *c, Ast *cond, int sense, List *jumps) {
+    if (cond->type != AST_AND_OP && cond->type != AST_OR_OP) {
+        compile(c, cond);
+        append_list(&c->instr, from_double(sense ? JE : JNE));
+        append_list(&c->instr, from_double(0));
+        append_list(jumps, from_double(c->instr.length - 1));
+        return;
     }
-    append_list(&c->instr, from_double(JMP));
-    int end_jmp_loc = instr_count(c);
-    append_list(&c->instr, from_double(0));
+    cond->eval_type = find_type(c, "Bool");
+    Ast *lhs = get_child(cond, 1);
+    Ast *rhs = get_child(cond, 0);
 
-    set_list(&c->instr, jmp_loc, from_double(instr_count(c))); // Shortcircuit
-    set_list(&c->instr, rhs_jmp_loc, from_double(instr_count(c)));
-    append_list(&c->instr, from_double(PUSOBJ));
-    append_list(&c->instr, from_ptr((void *) code->eval_type));
-    if (code->assoc_token->type == TOKEN_AND) {
-        append_list(&c->instr, false_val);
-    } else {
-        append_list(&c->instr, true_val);
-    }
-    set_list(&c->instr, end_jmp_loc, from_double(instr_count(c)));
+    // Value of the lhs that decides the whole expression without the rhs
+    int decides = cond->type == AST_OR_OP;
+    List skip;
+    ctor_list(&skip);
+    compile_cond_jump(c, lhs, decides, decides == sense ? jumps : &skip);
+    compile_cond_jump(c, rhs, sense, jumps);
+    patch_jumps(c, &skip);
+    dtor_list(&skip);
 
     if (lhs->eval_type->id != BOOL_TYPE || rhs->eval_type->id != BOOL_TYPE) {
-        error(code->assoc_token->line,
+        error(cond->assoc_token->line,
                 TYPE_ERROR,
                 "Cannot do boolean operations on non-booleans.\n");
         *c->enc_err = 1;
-        return;
     }
 }
 
+void compile_bool_op(Compiler *c, Ast *code) {
+    List jumps;
+    ctor_list(&jumps);
+    compile_cond_jump(c, code, 0, &jumps);
+
+    append_list(&c->instr, from_double(PUSH));
+    append_list(&c->instr, true_val);
+    append_list(&c->instr, from_double(JMP));
+    append_list(&c->instr, from_double(0));
+    int end_jmp_loc = c->instr.length - 1;
+
+    patch_jumps(c, &jumps);
+    append_list(&c->instr, from_double(PUSH));
+    append_list(&c->instr, false_val);
+    set_list(&c->instr, end_jmp_loc, from_double(instr_count(c)));
+    dtor_list(&jumps);
+}
+
 void compile_grouping(Compiler *c, Ast *code) {
     compile(c, code);
 }
@@ -305,6 +489,7 @@ void compile_literal(Compiler *c, Ast *code) {
     Value literal = code->assoc_token->literal;
     if (code->assoc_token->type == TOKEN_NUM) {
         code->eval_type = find_type(c, "Num");
+        code->known_int = is_int32(literal);
         append_list(&c->instr, from_double(PUSH));
         append_list(&c->instr, literal);
     } else if (code->assoc_token->type == TOKEN_STR) {
@@ -320,17 +505,13 @@ void compile_literal(Compiler *c, Ast *code) {
         append_list(&c->instr, from_ptr(str));
     } else if (code->assoc_token->type == TOKEN_TRUE ||
         code->assoc_token->type == TOKEN_FALSE) {
+        code->eval_type = find_type(c, "Bool");
         append_list(&c->instr, from_double(PUSH));
         append_list(&c->instr,
             code->assoc_token->type == TOKEN_TRUE ? true_val : false_val);
     } else if ((code->num_children > 0
             && get_child(code, 0)->type == AST_KEYVAL)
             || code->assoc_token->type == TOKEN_LPAREN) {
-        append_list(&c->instr, from_double(CONS_TUPLE));
-        // Need to fill in the type information after the rest compiles
-        append_list(&c->instr, nil_val);
-        int type_loc = c->instr.length - 1;
-        append_list(&c->instr, from_double(code->num_children));
         int is_record = get_child(code, 0)->type == AST_KEYVAL;
         for (int i = code->num_children - 1; i >= 0; i--) {
             Ast *child = get_child(code, i);
@@ -342,21 +523,7 @@ void compile_literal(Compiler *c, Ast *code) {
                 *c->enc_err = 1;
                 return;
             }
-            if (is_record && get_child(child, 0)->type == AST_LAMBDA_LIT) {
-                append_list(&c->instr, from_double(STO_REG));
-                append_list(&c->instr, from_double(A));
-            }
             compile(c, child);
-            if (is_record && get_child(child, 0)->type == AST_LAMBDA_LIT) {
-                append_list(&c->instr, from_double(STO_REG));
-                append_list(&c->instr, from_double(B));
-                append_list(&c->instr, from_double(LOAD_REG));
-                append_list(&c->instr, from_double(A));
-                append_list(&c->instr, from_double(LOAD_REG));
-                append_list(&c->instr, from_double(B));
-            }
-            append_list(&c->instr, from_double(SET_TUPLE));
-            append_list(&c->instr, from_double(i));
         }
         List types;
         ctor_list(&types);
@@ -388,8 +555,9 @@ void compile_literal(Compiler *c, Ast *code) {
             }
         }
         dtor_list(&slots);
-        // Go back and set the type
-        set_list(&c->instr, type_loc, from_ptr((void *) code->eval_type));
+        append_list(&c->instr, from_double(MAKE_TUPLE));
+        append_list(&c->instr, from_ptr((void *) code->eval_type));
+        append_list(&c->instr, from_double(code->num_children));
     }
 }
 
@@ -406,6 +574,7 @@ void compile_variable(Compiler *c, Ast *code) {
     append_list(&c->instr, from_double(sym->global ? GLOAD : LOAD));
     append_list(&c->instr, from_double(sym->loc));
     code->eval_type = sym->type;
+    code->known_int = sym->known_int;
 }
 
 void compile_keyval(Compiler *c, Ast *code) {
@@ -450,10 +619,10 @@ void compile_type_decl(Compiler *c, Ast *code) {
             *c->enc_err = 1;
             return;
         }
-        append_list(&c->instr, from_double(DUP));
+        if (!code->discarded) append_list(&c->instr, from_double(DUP));
         append_list(&c->instr, from_double(SET_DEFAULT_VAL));
         append_list(&c->instr, from_ptr((void *) type_name));
-    } else {
+    } else if (!code->discarded) {
         push_default_value(c, type, type->default_value);
     }
 
@@ -480,6 +649,7 @@ void compile_bind_local(Compiler *c, Ast *code) {
 void compile_decl(Compiler *c, Ast *code) {
     const Ang_Type *type = find_type(c, "Und");
     int has_assignment = 0;
+    Ast *value = 0;
     for (size_t i = 1; i < code->num_children; i++) {
         Ast *child = get_child(code, i);
         if (child->type == AST_TYPE ||
@@ -492,6 +662,7 @@ void compile_decl(Compiler *c, Ast *code) {
             if (!type) return;
         } else {
             has_assignment = 1;
+            value = child;
             compile(c, child);
             if (*c->enc_err) return;
         }
@@ -518,12 +689,18 @@ void compile_decl(Compiler *c, Ast *code) {
         return;
     }
     int mut = get_child(code, 0)->type == AST_MUT;
-    create_symbol(&c->env, sym, type, loc, mut, has_assignment, !local);
+    Symbol *symbol =
+        create_symbol(&c->env, sym, type, loc, mut, has_assignment, !local);
+    // Only an immutable variable keeps the value it was declared with
+    symbol->known_int = !mut && value && value->known_int;
 
-    if (!local) {
+    if (!local && !(value
+            && retarget_reg_op(c, value, REG_OPERAND(REG_GLOBAL, loc)))) {
         append_list(&c->instr, from_double(GSTORE));
         append_list(&c->instr, from_double(loc));
     }
+    // A local's value already sits in its slot, this pushes a copy
+    if (code->discarded) return;
     append_list(&c->instr, from_double(local ? LOAD : GLOAD));
     append_list(&c->instr, from_double(loc));
 }
@@ -588,6 +765,7 @@ void compile_destr_decl(Compiler *c, Ast *code) {
     int mut = get_child(code, 0)->type == AST_MUT;
     compile_destr_decl_helper(c, has_assignment, get_child(code, 1), tuple_type, mut);
 
+    if (code->discarded) return;
     if (has_assignment) {
         append_list(&c->instr, from_double(LOAD_REG));
         append_list(&c->instr, from_double(A));
@@ -603,6 +781,15 @@ void compile_destr_decl(Compiler *c, Ast *code) {
     }
 }
 
+// Whether a destructuring binds every slot to a name, with no wildcard or nesting
+static int only_names(const Ast *lhs) {
+    for (size_t i = 0; i < lhs->num_children; i++) {
+        Ast_Type type = get_child(lhs, i)->type;
+        if (type == AST_WILDCARD || type == AST_LITERAL) return 0;
+    }
+    return 1;
+}
+
 void compile_destr_decl_helper(Compiler *c, int has_assignment, Ast *lhs, const Ang_Type *ttype, int mut) {
     if (lhs->num_children > ttype->slot_types->length) {
         error(lhs->assoc_token->line,
@@ -612,6 +799,32 @@ void compile_destr_decl_helper(Compiler *c, int has_assignment, Ast *lhs, const
         return;
     }
     int local = c->parent != 0; // If the variables are global or local
+    if (has_assignment && only_names(lhs)) {
+        // Spread the slots over the stack, which is where locals live anyway
+        append_list(&c->instr, from_double(LOAD_REG));
+        append_list(&c->instr, from_double(A));
+        append_list(&c->instr, from_double(UNPACK_TUPLE));
+        append_list(&c->instr, from_double(lhs->num_children));
+        int locs[lhs->num_children];
+        for (size_t i = 0; i < lhs->num_children; i++) {
+            const char *sym = get_child(lhs, i)->assoc_token->lexeme;
+            const Ang_Type *slot_type =
+                get_ptr(access_list(ttype->slot_types, i));
+            locs[i] = local ? num_local(c) : c->env.symbols.size;
+            if (symbol_exists(&c->env, sym)) {
+                error(lhs->assoc_token->line, NAME_COLLISION, sym);
+                *c->enc_err = 1;
+                return;
+            }
+            create_symbol(&c->env, sym, slot_type, locs[i], mut, 1, !local);
+        }
+        // The last slot is on top
+        for (int i = lhs->num_children - 1; !local && i >= 0; i--) {
+            append_list(&c->instr, from_double(GSTORE));
+            append_list(&c->instr, from_double(locs[i]));
+        }
+        return;
+    }
     for (size_t i = 0; i < lhs->num_children; i++) {
         if (get_child(lhs, i)->type == AST_WILDCARD) continue;
 
@@ -684,6 +897,7 @@ static void compile_set_array(Compiler *c, Ast *code) {
         return;
     }
     append_list(&c->instr, from_double(SET_ARR));
+    if (code->discarded) append_list(&c->instr, from_double(POP));
 }
 
 void compile_assign(Compiler *c, Ast *code) {
@@ -714,7 +928,14 @@ void compile_assign(Compiler *c, Ast *code) {
         return;
     }
     sym->assigned = 1;
-    append_list(&c->instr, from_double(DUP));
+    uint32_t dest = REG_OPERAND(sym->global ? REG_GLOBAL : REG_LOCAL, sym->loc);
+    if (retarget_reg_op(c, get_child(code, 0), dest)) {
+        if (code->discarded) return;
+        append_list(&c->instr, from_double(sym->global ? GLOAD : LOAD));
+        append_list(&c->instr, from_double(sym->loc));
+        return;
+    }
+    if (!code->discarded) append_list(&c->instr, from_double(DUP));
     append_list(&c->instr, from_double(sym->global ? GSTORE : STORE));
     append_list(&c->instr, from_double(sym->loc));
 }
@@ -750,6 +971,11 @@ static char *construct_sum_type_name(List *types) {
     return type_name;
 }
 
+// Ids are unique per root so type relations can be memoized by id
+static int next_type_id(Compiler *c) {
+    return get_root_compiler(c)->num_type_ids++;
+}
+
 static Ang_Type *get_sum_type(Compiler *c, List *types) {
     remove_duplicate_types(types); // Remove duplicate types
     char *sum_type_name = construct_sum_type_name(types);
@@ -757,7 +983,7 @@ static Ang_Type *get_sum_type(Compiler *c, List *types) {
     if (!sum_type) {
         sum_type = calloc(1, sizeof(Ang_Type));
         ctor_ang_type(sum_type,
-                num_types(c),
+                next_type_id(c),
                 sum_type_name,
                 SUM,
                 ((Ang_Type *) get_ptr(access_list(types, 0)))->default_value);
@@ -801,7 +1027,7 @@ static Ang_Type *get_lambda_type(
     Ang_Type *lambda_type = find_type(c, lambda_name);
     if (!lambda_type) {
         lambda_type = calloc(1, sizeof(Ang_Type));
-        ctor_ang_type(lambda_type, num_types(c), lambda_name, LAMBDA, nil_val);
+        ctor_ang_type(lambda_type, next_type_id(c), lambda_name, LAMBDA, nil_val);
         lambda_type->slots = calloc(1, sizeof(Hashtable));
         lambda_type->slot_types = calloc(1, sizeof(List));
         ctor_hashtable(lambda_type->slots);
@@ -835,7 +1061,7 @@ static Ang_Type *get_array_type(Compiler *c, const Ang_Type *contains) {
     Ang_Type *type = find_type(c, name);
     if (!type) {
         type = calloc(1, sizeof(Ang_Type));
-        ctor_ang_type(type, num_types(c), name, ARRAY, nil_val);
+        ctor_ang_type(type, next_type_id(c), name, ARRAY, nil_val);
         type->slots = calloc(1, sizeof(Hashtable));
         type->slot_types = calloc(1, sizeof(List));
         ctor_list(type->slot_types);
@@ -995,7 +1221,7 @@ Ang_Type *get_tuple_type(Compiler *c, const List *slots, const List *types) {
     char *type_name = construct_tuple_name(slots, types);
     Ang_Type *tuple_type = find_type(c, type_name);
     if (!tuple_type) {
-        tuple_type = construct_tuple(slots, types, num_types(c) + 1, type_name);
+        tuple_type = construct_tuple(slots, types, next_type_id(c), type_name);
         add_type(&get_root_compiler(c)->env, tuple_type);
     } else {
         free(type_name);
@@ -1008,6 +1234,7 @@ void compile_block(Compiler *c, Ast *code) {
     ctor_compiler(&block);
     block.enc_err = c->enc_err;
     block.parent = c;
+    block.reg_vm = c->reg_vm;
 
     List return_types;
     ctor_list(&return_types);
@@ -1015,12 +1242,11 @@ void compile_block(Compiler *c, Ast *code) {
     // Compile all block expressions
     for (size_t i = 0; i < code->num_children; i++) {
         Ast *child = get_child(code, i);
-        compile(&block, child);
+        if (i + 1 != code->num_children) compile_statement(&block, child);
+        else compile(&block, child);
         if (*c->enc_err) {
             break;
         }
-        if (i + 1 != code->num_children)
-            append_list(&block.instr, from_double(POP));
 
         // Is return or last statement
         if (child->type == AST_RET_EXPR || i + 1 == code->num_children) {
@@ -1064,14 +1290,87 @@ void compile_block(Compiler *c, Ast *code) {
     dtor_compiler(&block);
 }
 
+/* Marks the expressions in code whose value is returned as is, which is code
+ * itself along with the last expression and returns of blocks and match arms.
+ */
+static void mark_tail(Ast *code) {
+    code->tail = 1;
+    switch (code->type) {
+    case AST_BLOCK:
+        for (int i = 0; i < code->num_children; i++) {
+            Ast *child = get_child(code, i);
+            if (i + 1 == code->num_children || child->type == AST_RET_EXPR) {
+                mark_tail(child);
+            } else if (child->type == AST_PATTERN) {
+                mark_tail(get_child(child, 1));
+            }
+        }
+        break;
+    case AST_RET_EXPR:
+        mark_tail(get_child(code, 0));
+        break;
+    case AST_PATTERN_MATCH:
+        mark_tail(get_child(code, 1));
+        break;
+    case AST_PATTERN:
+        mark_tail(get_child(code, 1));
+        break;
+    default:
+        break;
+    }
+}
+
+/* Collects the names of the locals of c that code refers to. Names shadowed
+ * inside code are captured as well, which is harmless.
+ */
+static void collect_captures(const Compiler *c, Ast *code, List *captures) {
+    if (code->type == AST_VARIABLE) {
+        const char *name = code->assoc_token->lexeme;
+        const Symbol *sym = find_symbol(c, name);
+        if (!sym || sym->global) return;
+        for (size_t i = 0; i < captures->length; i++) {
+            if (strcmp(get_ptr(access_list(captures, i)), name) == 0) return;
+        }
+        append_list(captures, from_ptr((void *) name));
+        return;
+    }
+    for (int i = 0; i < code->num_children; i++) {
+        collect_captures(c, get_child(code, i), captures);
+    }
+}
+
 void compile_lambda(Compiler *c, Ast *code) {
+    Ast *block = get_child(code, 0);
+    List captures;
+    ctor_list(&captures);
+    collect_captures(c, block, &captures);
+
     append_list(&c->instr, from_double(JMP));
     append_list(&c->instr, nil_val);
     int jmp_loc = c->instr.length - 1;
     int ip = instr_count(c); // Instruction pointer for call
 
-    Ast *block = get_child(code, 0);
-    compile_block(c, block);
+    // The body's frame starts with the captured values in order
+    Compiler closure;
+    ctor_compiler(&closure);
+    closure.enc_err = c->enc_err;
+    closure.parent = c;
+    closure.reg_vm = c->reg_vm;
+    closure.closure = 1;
+    for (size_t i = 0; i < captures.length; i++) {
+        const char *name = get_ptr(access_list(&captures, i));
+        const Symbol *outer = find_symbol(c, name);
+        Symbol *sym = create_symbol(&closure.env,
+            name, outer->type, i, outer->mut, outer->assigned, 0);
+        sym->known_int = outer->known_int;
+    }
+
+    mark_tail(block);
+    compile_block(&closure, block);
+    for (size_t i = 0; i < closure.instr.length; i++) {
+        append_list(&c->instr, access_list(&closure.instr, i));
+    }
+    dtor_compiler(&closure);
     const Ang_Type *lhs_type = get_child(block, 0)->eval_type;
     const Ang_Type *rhs_type = block->eval_type;
     code->eval_type = get_lambda_type(c, lhs_type, rhs_type);
@@ -1079,9 +1378,16 @@ void compile_lambda(Compiler *c, Ast *code) {
 
     set_list(&c->instr, jmp_loc, from_double(instr_count(c)));
 
+    for (size_t i = 0; i < captures.length; i++) {
+        const Symbol *sym = find_symbol(c, get_ptr(access_list(&captures, i)));
+        append_list(&c->instr, from_double(LOAD));
+        append_list(&c->instr, from_double(sym->loc));
+    }
     append_list(&c->instr, from_double(CONS_LAMBDA));
     append_list(&c->instr, from_ptr((void *) code->eval_type));
     append_list(&c->instr, from_double(ip));
+    append_list(&c->instr, from_double(captures.length));
+    dtor_list(&captures);
 }
 
 void compile_lambda_call(Compiler *c, Ast *code) {
@@ -1113,7 +1419,7 @@ void compile_lambda_call(Compiler *c, Ast *code) {
         return;
     }
     code->eval_type = get_ptr(access_list(lambda_type->slot_types, 1));
-    append_list(&c->instr, from_double(CALL));
+    append_list(&c->instr, from_double(code->tail ? TAIL_CALL : CALL));
 }
 
 void compile_placeholder(Compiler *c, Ast *code) {
@@ -1126,20 +1432,40 @@ void compile_pattern(Compiler *c, Ast *code) {
     Ast *lhs = get_child(code, 0);
     Ast *rhs = get_child(code, 1);
 
-    append_list(&c->instr, from_double(LOAD_REG));
-    append_list(&c->instr, from_double(A));
-    if (lhs->type == AST_LITERAL) {
-        compile(c, lhs);
+    if (c->reg_vm && lhs->type == AST_LITERAL
+            && lhs->assoc_token->type == TOKEN_NUM) {
+        // Compare register A against the literal in place
+        uint32_t operands[2] = {
+            REG_OPERAND(REG_VM, A),
+            compile_reg_operand(c, lhs, 1, 0)
+        };
+        emit_reg_op(c, EQ_R, REG_OPERAND(REG_STACK, 0), operands);
+    } else if (lhs->type != AST_WILDCARD) {
+        append_list(&c->instr, from_double(LOAD_REG));
+        append_list(&c->instr, from_double(A));
+        if (lhs->type == AST_LITERAL) {
+            compile(c, lhs);
 
-        if (lhs->eval_type->id == NUM_TYPE || lhs->eval_type->id == BOOL_TYPE) {
-            append_list(&c->instr, from_double(EQ));
+            if (lhs->eval_type->id == NUM_TYPE || lhs->eval_type->id == BOOL_TYPE) {
+                append_list(&c->instr, from_double(EQ));
+            }
+        } else if (lhs->type == AST_TYPE) {
+            Ang_Type *type = compile_type(c, lhs);
+            if (!type) return;
+            // Primitives are told apart by their tag, without a cache
+            Opcode test = primitive_cmp(type);
+            append_list(&c->instr, from_double(test));
+            append_list(&c->instr, from_ptr(type));
+            if (test == CMP_TYPE) {
+                append_list(&c->instr,
+                    from_double(get_root_compiler(c)->num_caches++));
+            }
+        } else {
+            append_list(&c->instr, from_double(CMP_STRUCT));
+            append_list(&c->instr, from_ptr(compile_type(c, lhs)));
+            append_list(&c->instr,
+                from_double(get_root_compiler(c)->num_caches++));
         }
-    } else if (lhs->type == AST_TYPE) {
-        append_list(&c->instr, from_double(CMP_TYPE));
-        append_list(&c->instr, from_ptr(compile_type(c, lhs)));
-    } else if (lhs->type != AST_WILDCARD) {
-        append_list(&c->instr, from_double(CMP_STRUCT));
-        append_list(&c->instr, from_ptr(compile_type(c, lhs)));
     }
 
     if (lhs->type != AST_WILDCARD) {
@@ -1236,20 +1562,17 @@ void push_default_value(Compiler *c, const Ang_Type *t, Value default_value) {
             append_list(&c->instr, from_ptr((Ang_Type *) t));
         } else {
             // Construct default value
-            append_list(&c->instr, from_double(CONS_TUPLE));
-            // Push on the type of the object
-            Value type_val = from_ptr((void *) t);
-            append_list(&c->instr, type_val);
-            // Push the number of slots
-            append_list(&c->instr, from_double(t->slot_types->length));
-
             const List *def_val = get_ptr(default_value);
             for (int i = t->slot_types->length - 1; i >= 0; i--) {
                 const Ang_Type *slot_type = get_ptr(access_list(t->slot_types, i));
                 push_default_value(c, slot_type, access_list(def_val, i));
-                append_list(&c->instr, from_double(SET_TUPLE));
-                append_list(&c->instr, from_double(i));
             }
+            append_list(&c->instr, from_double(MAKE_TUPLE));
+            // Push on the type of the object
+            Value type_val = from_ptr((void *) t);
+            append_list(&c->instr, type_val);
+            // Push the number of slots
+            append_list(&c->instr, from_double(t->slot_types->length));
         }
     } else if (t->cat == ARRAY) {
         append_list(&c->instr, from_double(CONS_ARR));
@@ -1271,7 +1594,10 @@ Symbol *find_symbol(const Compiler *c, const char *sym) {
     if (symbol.bits != nil_val.bits) {
         return get_ptr(symbol);
     }
-    return find_symbol(c->parent, sym);
+    Symbol *outer = find_symbol(c->parent, sym);
+    // A lambda only reaches the locals outside it through its captures
+    if (c->closure && outer && !outer->global) return 0;
+    return outer;
 }
 
 Ang_Type *find_type(const Compiler *c, const char *sym) {
@@ -1287,6 +1613,7 @@ size_t num_local(const Compiler *c) {
     size_t num = 0;
     while (c) {
         if (c->parent) num += c->env.symbols.size;
+        if (c->closure) break;
         c = c->parent;
     }
     return num;
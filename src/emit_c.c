@@ -0,0 +1,453 @@
+#include "emit_c.h"
+
+#include "ang_opcodes.h"
+#include "ang_ops.h"
+
+#define MAX_OPERANDS 3
+
+// Decodes the instruction at ip, returning the ip of the next one
+static size_t decode(const Code *code, size_t ip, uint32_t *operands) {
+    const uint8_t *pc = code->bytes + ip + 1;
+    for (int i = 0; i < num_ops(code->bytes[ip]); i++) {
+        operands[i] = read_uint(&pc);
+    }
+    return pc - code->bytes;
+}
+
+static int32_t unzigzag(uint32_t n) {
+    return (int32_t) (n >> 1) ^ -(int32_t) (n & 1);
+}
+
+static void emit_value(FILE *out, Value v) {
+    fprintf(out, "(Value) { .bits = 0x%llxull }", (unsigned long long) v.bits);
+}
+
+// Pointers are only known once the program has loaded its code
+static void emit_const(FILE *out, const Code *code, uint32_t i) {
+    if (is_ptr(code->consts[i])) fprintf(out, "consts[%u]", i);
+    else emit_value(out, code->consts[i]);
+}
+
+static void emit_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '\n' && s[1]) {
+            fputs("\\n\"\n    \"", out);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < ' ' || c >= 0x7f) {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Expression computing a binary instruction's result from left and right
+static const char *binary_expr(Opcode op) {
+    switch (op) {
+    case ADD: case ADD_R: return "INT_CODE(left, right, +)";
+    case SUB: case SUB_R: return "INT_CODE(left, right, -)";
+    case MUL: case MUL_R: return "INT_CODE(left, right, *)";
+    case ADDF: case ADDF_R: return "NUM_CODE(left, right, +)";
+    case SUBF: case SUBF_R: return "NUM_CODE(left, right, -)";
+    case MULF: case MULF_R: return "NUM_CODE(left, right, *)";
+    case DIVF: case DIVF_R: return "NUM_CODE(left, right, /)";
+    case LT: case LT_R: return "BOOL_CODE(NUM_CMP(left, right, <))";
+    case LE: case LE_R: return "BOOL_CODE(NUM_CMP(left, right, <=))";
+    case GT: case GT_R: return "BOOL_CODE(NUM_CMP(left, right, >))";
+    case GE: case GE_R: return "BOOL_CODE(NUM_CMP(left, right, >=))";
+    case EQ_NUM: return "BOOL_CODE(NUM_CMP(left, right, ==))";
+    case NE_NUM: return "BOOL_CODE(NUM_CMP(left, right, !=))";
+    case EQ: case EQ_R: return "BOOL_CODE(values_equal(left, right))";
+    case NE_R: return "BOOL_CODE(!values_equal(left, right))";
+    default: return 0;
+    }
+}
+
+// Value of a register instruction operand
+static void emit_reg_read(FILE *out, uint32_t operand) {
+    uint32_t index = operand >> REG_KIND_BITS;
+    switch (operand & ((1 << REG_KIND_BITS) - 1)) {
+    case REG_LOCAL:
+        fprintf(out, "fp[%u]", index);
+        break;
+    case REG_GLOBAL:
+        fprintf(out, "gmem[%u]", index);
+        break;
+    case REG_VM:
+        fprintf(out, "registers[%u]", index);
+        break;
+    case REG_IMM:
+        emit_value(out, from_double(unzigzag(index)));
+        break;
+    case REG_TEMP:
+        fprintf(out, "sp[%u]", index);
+        break;
+    default:
+        fputs("AOT_POP()", out);
+        break;
+    }
+}
+
+static void emit_reg_write(FILE *out, uint32_t operand, const char *expr) {
+    uint32_t index = operand >> REG_KIND_BITS;
+    switch (operand & ((1 << REG_KIND_BITS) - 1)) {
+    case REG_LOCAL:
+        fprintf(out, "fp[%u] = %s;", index, expr);
+        break;
+    case REG_GLOBAL:
+        fprintf(out, "gmem[%u] = %s;", index, expr);
+        break;
+    case REG_VM:
+        fprintf(out, "registers[%u] = %s;", index, expr);
+        break;
+    case REG_TEMP:
+        fprintf(out, "sp[%u] = %s;", index, expr);
+        break;
+    default:
+        fprintf(out, "AOT_PUSH(%s);", expr);
+        break;
+    }
+}
+
+static void emit_cmp(FILE *out, Opcode op, const uint32_t *operands) {
+    if (op == CMP_TYPE || op == CMP_STRUCT) {
+        fprintf(out, "    sp[-1] = BOOL_CODE(aot_cmp_type(vm, sp[-1], consts[%u], %u, %d));\n",
+            operands[0], operands[1], op == CMP_STRUCT);
+        return;
+    }
+    fprintf(out, "    sp[-1] = BOOL_CODE(quick_cmp_type(%s, sp[-1], get_ptr(consts[%u])));\n",
+        opcode_to_str(op), operands[0]);
+}
+
+// Returns 0 if the instruction at ip has no translation
+static int emit_instr(FILE *out, const Code *code, size_t ip, size_t next) {
+    Opcode op = code->bytes[ip];
+    uint32_t operands[MAX_OPERANDS] = { 0 };
+    decode(code, ip, operands);
+    const char *expr = binary_expr(op);
+    if (expr && op >= ADD_R && op <= NE_R) {
+        // The right operand is read first so it is the one popped first
+        fputs("    {\n        Value right = ", out);
+        emit_reg_read(out, operands[2]);
+        fputs(";\n        Value left = ", out);
+        emit_reg_read(out, operands[1]);
+        fputs(";\n        ", out);
+        emit_reg_write(out, operands[0], expr);
+        fputs("\n    }\n", out);
+        return 1;
+    }
+    if (expr) {
+        fprintf(out, "    {\n"
+            "        Value right = AOT_POP();\n"
+            "        Value left = sp[-1];\n"
+            "        sp[-1] = %s;\n"
+            "    }\n", expr);
+        return 1;
+    }
+    switch (op) {
+    case HALT:
+        // Leave ip on the HALT so newly loaded code resumes from here
+        fprintf(out, "    AOT_SAVE();\n"
+            "    vm->mem.ip = %zu;\n"
+            "    vm->running = 0;\n"
+            "    return;\n", ip);
+        break;
+    case PUSH:
+        fputs("    AOT_PUSH(", out);
+        emit_const(out, code, operands[0]);
+        fputs(");\n", out);
+        break;
+    case PUSH_INT:
+    case PUSH_0:
+        fputs("    AOT_PUSH(", out);
+        emit_value(out, from_double(op == PUSH_0 ? 0 : unzigzag(operands[0])));
+        fputs(");\n", out);
+        break;
+    case PUSOBJ:
+        fprintf(out, "    AOT_SAVE();\n"
+            "    aot_pusobj(vm, consts[%u], consts[%u]);\n"
+            "    AOT_LOAD();\n", operands[0], operands[1]);
+        break;
+    case POP:
+        fputs("    sp--;\n", out);
+        break;
+    case POPN:
+        fprintf(out, "    sp -= %u;\n", operands[0]);
+        break;
+    case DIV:
+        fputs("    {\n"
+            "        int right = int_value(AOT_POP());\n"
+            "        sp[-1] = from_double(int_value(sp[-1]) / right);\n"
+            "    }\n", out);
+        break;
+    case NEG:
+        fputs("    sp[-1] = sp[-1].bits == true_val.bits ? false_val : true_val;\n", out);
+        break;
+    case CMP_TYPE:
+    case CMP_STRUCT:
+    case CMP_NUM:
+    case CMP_BOOL:
+    case CMP_NULL:
+    case CMP_STRING:
+        emit_cmp(out, op, operands);
+        break;
+    case JE:
+    case JNE:
+        fprintf(out, "    if (AOT_POP().bits == %s.bits) goto L%u;\n",
+            op == JE ? "true_val" : "false_val", operands[0]);
+        break;
+    case JMP:
+        fprintf(out, "    goto L%u;\n", operands[0]);
+        break;
+    case GSTORE:
+        fprintf(out, "    gmem[%u] = AOT_POP();\n", operands[0]);
+        break;
+    case GLOAD:
+        fprintf(out, "    AOT_PUSH(gmem[%u]);\n", operands[0]);
+        break;
+    case STORE:
+        fprintf(out, "    fp[%u] = AOT_POP();\n", operands[0]);
+        break;
+    case LOAD:
+        fprintf(out, "    AOT_PUSH(fp[%u]);\n", operands[0]);
+        break;
+    case STORET:
+        fputs("    registers[RET_VAL] = AOT_POP();\n", out);
+        break;
+    case PUSRET:
+        fputs("    AOT_PUSH(registers[RET_VAL]);\n", out);
+        break;
+    case MAKE_TUPLE:
+        fprintf(out, "    AOT_SAVE();\n"
+            "    aot_make_tuple(vm, consts[%u], %u);\n"
+            "    AOT_LOAD();\n", operands[0], operands[1]);
+        break;
+    case UNPACK_TUPLE:
+        fprintf(out, "    {\n"
+            "        List *vals = get_ptr(((Ang_Obj *) get_ptr(AOT_POP()))->v);\n"
+            "        for (int i = 0; i < %u; i++) AOT_PUSH(access_list(vals, i));\n"
+            "    }\n", operands[0]);
+        break;
+    case LOAD_TUPLE:
+        fputs("    {\n"
+            "        int slot_num = int_value(AOT_POP());\n"
+            "        Ang_Obj *tuple = get_ptr(sp[-1]);\n"
+            "        Ang_Obj *obj = get_ptr(access_list(get_ptr(tuple->v), slot_num));\n"
+            "        sp[-1] = from_ptr(obj);\n"
+            "    }\n", out);
+        break;
+    case CONS_ARR:
+        fprintf(out, "    AOT_SAVE();\n"
+            "    aot_cons_arr(vm, consts[%u], %u);\n"
+            "    AOT_LOAD();\n", operands[0], operands[1]);
+        break;
+    case ACCESS_ARR:
+        fputs("    {\n"
+            "        List *arr = get_ptr(((Ang_Obj *) get_ptr(AOT_POP()))->v);\n"
+            "        Value index = sp[-1];\n"
+            "        sp[-1] = !is_int32(index) || index.as_int32 >= arr->length\n"
+            "            ? nil_val\n"
+            "            : access_list(arr, index.as_int32);\n"
+            "    }\n", out);
+        break;
+    case SET_ARR:
+        fputs("    {\n"
+            "        Ang_Obj *arr_obj = get_ptr(AOT_POP());\n"
+            "        Value index = AOT_POP();\n"
+            "        Ang_Obj *rhs = get_ptr(sp[-1]);\n"
+            "        List *arr = get_ptr(arr_obj->v);\n"
+            "        if (!is_int32(index) || index.as_int32 >= arr->length) {\n"
+            "            runtime_error(ARR_OUT_OF_BOUNDS,\n"
+            "                \"Attempted to assign out of array bounds.\\n\");\n"
+            "        }\n"
+            "        set_list(arr, index.as_int32, from_ptr(rhs));\n"
+            "        write_barrier(&vm->mem, arr_obj, from_ptr(rhs));\n"
+            "        sp[-1] = from_ptr(arr_obj);\n"
+            "    }\n", out);
+        break;
+    case CONS_LAMBDA:
+        fprintf(out, "    AOT_SAVE();\n"
+            "    aot_cons_lambda(vm, consts[%u], %u, %u);\n"
+            "    AOT_LOAD();\n", operands[0], operands[1], operands[2]);
+        break;
+    case SET_FP:
+        fputs("    vm->mem.fp = sp - vm->mem.stack;\n"
+            "    fp = sp;\n", out);
+        break;
+    case RESET_FP:
+        fputs("    vm->mem.fp = 0;\n"
+            "    fp = vm->mem.stack;\n", out);
+        break;
+    case DUP:
+        fputs("    sp[0] = sp[-1];\n"
+            "    sp++;\n", out);
+        break;
+    case SET_DEFAULT_VAL:
+    case SET_DEFAULT_VAL_RESOLVED:
+        // Like quickening, the type is looked up and rooted the first time
+        fprintf(out, "    if (!type%zu) {\n", ip);
+        if (code->bytes[ip] == SET_DEFAULT_VAL) {
+            fprintf(out, "        type%zu = find_type(&vm->compiler, get_ptr(consts[%u]));\n",
+                ip, operands[0]);
+        } else {
+            fprintf(out, "        type%zu = get_ptr(consts[%u]);\n", ip, operands[0]);
+        }
+        fprintf(out, "        add_root(&vm->mem, &type%zu->default_value);\n"
+            "    }\n"
+            "    type%zu->default_value = AOT_POP();\n", ip, ip);
+        break;
+    case LOAD_DEFAULT_VAL:
+        fprintf(out, "    AOT_PUSH(((Ang_Type *) get_ptr(consts[%u]))->default_value);\n",
+            operands[0]);
+        break;
+    case STO_REG:
+        fprintf(out, "    registers[%u] = AOT_POP();\n", operands[0]);
+        break;
+    case LOAD_REG:
+        fprintf(out, "    AOT_PUSH(registers[%u]);\n", operands[0]);
+        break;
+    case SWAP_REG:
+        fprintf(out, "    {\n"
+            "        Value tmp = registers[%u];\n"
+            "        registers[%u] = registers[%u];\n"
+            "        registers[%u] = tmp;\n"
+            "    }\n", operands[0], operands[0], operands[1], operands[1]);
+        break;
+    case MOV_REG:
+        fprintf(out, "    registers[%u] = registers[%u];\n", operands[1], operands[0]);
+        break;
+    case CALL:
+    case TAIL_CALL:
+        fputs("    AOT_SAVE();\n", out);
+        if (op == CALL) fprintf(out, "    ip = call_lambda(vm, %zu);\n", next);
+        else fputs("    ip = tail_call_lambda(vm);\n", out);
+        fputs("    if (ip == CALL_ABORTED) return;\n"
+            "    AOT_LOAD();\n"
+            "    goto dispatch;\n", out);
+        break;
+    case RET:
+        fputs("    AOT_SAVE();\n"
+            "    ip = return_lambda(vm);\n"
+            "    AOT_LOAD();\n"
+            "    goto dispatch;\n", out);
+        break;
+    case POPN_KEEP:
+        fprintf(out, "    sp[-%u] = sp[-1];\n"
+            "    sp -= %u;\n", operands[0] + 1, operands[0]);
+        break;
+    case LOAD_SLOT:
+        fprintf(out, "    sp[-1] = access_list(get_ptr(((Ang_Obj *) get_ptr(sp[-1]))->v), %u);\n",
+            operands[0]);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+int emit_c(const Ang_VM *vm, const char *source, const char *src_name, FILE *out) {
+    const Code *code = &vm->code;
+    if (code->verified != code->length) return 0;
+
+    /* Instructions jumped to get labels, and the ones calls and returns go to
+     * are also dispatched to by ip
+     */
+    char *label = calloc(code->length + 1, sizeof(char));
+    char *dispatched = calloc(code->length + 1, sizeof(char));
+    label[0] = dispatched[0] = 1;
+    int calls = 0;
+    for (size_t ip = 0; ip < code->length;) {
+        uint32_t operands[MAX_OPERANDS];
+        size_t next = decode(code, ip, operands);
+        switch (code->bytes[ip]) {
+        case JMP:
+        case JE:
+        case JNE:
+            label[operands[0]] = 1;
+            break;
+        case CONS_LAMBDA:
+            label[operands[1]] = dispatched[operands[1]] = 1;
+            break;
+        case CALL:
+            label[next] = dispatched[next] = 1;
+            calls = 1;
+            break;
+        case TAIL_CALL:
+        case RET:
+            calls = 1;
+            break;
+        default:
+            break;
+        }
+        ip = next;
+    }
+
+    fputs("/* Compiled by angstrom --emit-c */\n"
+        "#include \"aot.h\"\n"
+        "#include \"error.h\"\n"
+        "\n"
+        "static const char source[] =\n    ", out);
+    emit_string(out, source);
+    fputs(";\n"
+        "\n"
+        "static void run(void *arg) {\n"
+        "    Ang_VM *vm = arg;\n"
+        "    const Value *consts = vm->code.consts;\n"
+        "    Value *gmem = vm->mem.gmem;\n"
+        "    Value *registers = vm->mem.registers;\n"
+        "    Value *sp, *fp;\n"
+        "    size_t ip = vm->mem.ip;\n"
+        "    (void) consts;\n"
+        "    (void) gmem;\n"
+        "    (void) registers;\n"
+        "    int depth = frame_depth(&vm->code, ip);\n"
+        "    if (depth >= 0) grow_stack(&vm->mem, vm->mem.sp + depth);\n"
+        "    AOT_LOAD();\n"
+        "    (void) fp;\n"
+        "    vm->running = 1;\n", out);
+    for (size_t ip = 0; ip < code->length;) {
+        uint32_t operands[MAX_OPERANDS];
+        size_t next = decode(code, ip, operands);
+        if (code->bytes[ip] == SET_DEFAULT_VAL
+                || code->bytes[ip] == SET_DEFAULT_VAL_RESOLVED) {
+            fprintf(out, "    Ang_Type *type%zu = 0;\n", ip);
+        }
+        ip = next;
+    }
+    if (calls) fputs("dispatch:\n", out);
+    fputs("    switch (ip) {\n", out);
+    for (size_t ip = 0; ip <= code->length; ip++) {
+        if (dispatched[ip]) fprintf(out, "    case %zu: goto L%zu;\n", ip, ip);
+    }
+    fputs("    default: return;\n"
+        "    }\n", out);
+
+    for (size_t ip = 0; ip <= code->length;) {
+        uint32_t operands[MAX_OPERANDS];
+        size_t next = ip < code->length ? decode(code, ip, operands) : ip + 1;
+        if (label[ip]) fprintf(out, "L%zu:\n", ip);
+        if (!emit_instr(out, code, ip, next)) {
+            free(label);
+            free(dispatched);
+            return 0;
+        }
+        ip = next;
+    }
+    fputs("}\n"
+        "\n"
+        "int main(void) {\n"
+        "    return run_compiled(source, ", out);
+    emit_string(out, src_name);
+    fprintf(out, ", %d, %zu, 0x%xu, run);\n"
+        "}\n", vm->compiler.reg_vm, code->length, code_checksum(code));
+
+    free(label);
+    free(dispatched);
+    return 1;
+}
@@ -0,0 +1,599 @@
+#define _DEFAULT_SOURCE // mmap isn't part of C99
+#include "jit.h"
+
+#include <string.h>
+#include <stdint.h>
+#include "ang_ops.h"
+
+void ctor_jit(Jit *jit) {
+    jit->enabled = 0;
+    jit->functions = 0;
+    jit->num_functions = 0;
+}
+
+static void free_function(Jit_Function *f);
+
+void dtor_jit(Jit *jit) {
+    for (size_t i = 0; i < jit->num_functions; i++) {
+        free_function(jit->functions[i]);
+    }
+    free(jit->functions);
+    jit->functions = 0;
+    jit->num_functions = 0;
+}
+
+// Index of the function entered at entry, or of where it would go
+static size_t function_index(const Jit *jit, size_t entry) {
+    size_t lo = 0;
+    size_t hi = jit->num_functions;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (jit->functions[mid]->entry < entry) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+const Jit_Function *jit_find(const Jit *jit, size_t entry) {
+    size_t i = function_index(jit, entry);
+    if (i == jit->num_functions || jit->functions[i]->entry != entry) return 0;
+    return jit->functions[i]->native ? jit->functions[i] : 0;
+}
+
+const void *jit_address(const Jit_Function *f, size_t ip) {
+    if (ip < f->start || ip >= f->end) return 0;
+    uint32_t offset = f->offsets[ip - f->start];
+    return offset ? f->native + offset : 0;
+}
+
+#ifdef ANG_JIT
+
+#include <sys/mman.h>
+
+/** Where native code keeps the interpreter's state while it runs
+ * The pointers are loaded into callee saved registers on entry and sp is
+ * written back on exit.
+ */
+typedef struct {
+    Value *sp;
+    Value *fp;
+    Value *gmem;
+    Value *registers;
+} Jit_Regs;
+
+typedef size_t (*Jit_Entry)(Jit_Regs *regs, const void *target);
+
+static void free_function(Jit_Function *f) {
+    if (f->native) munmap(f->native, f->native_size);
+    free(f->offsets);
+    free(f);
+}
+
+size_t jit_run(const Jit_Function *f, const void *target, Memory *mem) {
+    Jit_Regs regs = {
+        mem->stack + mem->sp,
+        mem->stack + mem->fp,
+        mem->gmem,
+        mem->registers
+    };
+    size_t ip = ((Jit_Entry) (uintptr_t) f->native)(&regs, target);
+    mem->sp = regs.sp - mem->stack;
+    return ip;
+}
+
+/* Helpers for the instructions too big to inline. They get the stack pointer
+ * and return it moved past what they popped and pushed, doing exactly what the
+ * interpreter does.
+ */
+#define BINARY_HELPER(name, expr) \
+    static Value *name(Value *sp) { \
+        Value right = *--sp; \
+        Value left = sp[-1]; \
+        sp[-1] = expr; \
+        return sp; \
+    }
+BINARY_HELPER(add, INT_CODE(left, right, +))
+BINARY_HELPER(sub, INT_CODE(left, right, -))
+BINARY_HELPER(mul, INT_CODE(left, right, *))
+BINARY_HELPER(addf, NUM_CODE(left, right, +))
+BINARY_HELPER(subf, NUM_CODE(left, right, -))
+BINARY_HELPER(mulf, NUM_CODE(left, right, *))
+BINARY_HELPER(divf, NUM_CODE(left, right, /))
+BINARY_HELPER(lt, BOOL_CODE(NUM_CMP(left, right, <)))
+BINARY_HELPER(le, BOOL_CODE(NUM_CMP(left, right, <=)))
+BINARY_HELPER(gt, BOOL_CODE(NUM_CMP(left, right, >)))
+BINARY_HELPER(ge, BOOL_CODE(NUM_CMP(left, right, >=)))
+BINARY_HELPER(eq_num, BOOL_CODE(NUM_CMP(left, right, ==)))
+BINARY_HELPER(ne_num, BOOL_CODE(NUM_CMP(left, right, !=)))
+BINARY_HELPER(eq, BOOL_CODE(values_equal(left, right)))
+BINARY_HELPER(ne, BOOL_CODE(!values_equal(left, right)))
+#undef BINARY_HELPER
+
+static Value *neg(Value *sp) {
+    sp[-1] = sp[-1].bits == true_val.bits ? false_val : true_val;
+    return sp;
+}
+
+static Value *load_slot(Value *sp, uint32_t slot) {
+    Ang_Obj *tuple = get_ptr(sp[-1]);
+    sp[-1] = access_list(get_ptr(tuple->v), slot);
+    return sp;
+}
+
+static Value *unpack_tuple(Value *sp, uint32_t num_slots) {
+    List *vals = get_ptr(((Ang_Obj *) get_ptr(*--sp))->v);
+    for (uint32_t i = 0; i < num_slots; i++) {
+        *sp++ = access_list(vals, i);
+    }
+    return sp;
+}
+
+#define QUICK_CMP_HELPER(name, quick) \
+    static Value *name(Value *sp, const Ang_Type *t2) { \
+        sp[-1] = BOOL_CODE(quick_cmp_type(quick, sp[-1], t2)); \
+        return sp; \
+    }
+QUICK_CMP_HELPER(cmp_num, CMP_NUM)
+QUICK_CMP_HELPER(cmp_bool, CMP_BOOL)
+QUICK_CMP_HELPER(cmp_null, CMP_NULL)
+QUICK_CMP_HELPER(cmp_string, CMP_STRING)
+#undef QUICK_CMP_HELPER
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void emit(Buffer *b, const void *bytes, size_t n) {
+    if (b->length + n > b->capacity) {
+        while (b->length + n > b->capacity) b->capacity = b->capacity * 2 + 64;
+        b->bytes = realloc(b->bytes, b->capacity);
+    }
+    memcpy(b->bytes + b->length, bytes, n);
+    b->length += n;
+}
+
+#define EMIT(b, ...) \
+    { \
+    static const uint8_t bytes[] = { __VA_ARGS__ }; \
+    emit(b, bytes, sizeof(bytes)); }
+
+static void emit_u32(Buffer *b, uint32_t n) {
+    emit(b, &n, sizeof(n));
+}
+
+static void emit_u64(Buffer *b, uint64_t n) {
+    emit(b, &n, sizeof(n));
+}
+
+/* While native code runs rbx holds the Jit_Regs, r12 the stack pointer, r13
+ * the frame pointer, r14 gmem and r15 the registers. rax and rcx are scratch.
+ */
+#define RAX 0
+#define RCX 1
+#define STACK 4 // r12
+#define LOCALS 5 // r13
+#define GLOBALS 6 // r14
+#define REGISTERS 7 // r15
+
+static void emit_push_rax(Buffer *b) {
+    EMIT(b, 0x49, 0x89, 0x04, 0x24) // mov [r12], rax
+    EMIT(b, 0x49, 0x83, 0xc4, 0x08) // add r12, 8
+}
+
+static void emit_pop_rax(Buffer *b) {
+    EMIT(b, 0x49, 0x83, 0xec, 0x08) // sub r12, 8
+    EMIT(b, 0x49, 0x8b, 0x04, 0x24) // mov rax, [r12]
+}
+
+// [base + index * 8] as the operand of reg
+static void emit_address(Buffer *b, int reg, int base, uint32_t index) {
+    uint8_t modrm = 0x80 | reg << 3 | base;
+    emit(b, &modrm, 1);
+    if (base == STACK) EMIT(b, 0x24) // r12 is only a base with a SIB byte
+    emit_u32(b, index * sizeof(Value));
+}
+
+// mov reg, [base + index * 8]
+static void emit_load(Buffer *b, int reg, int base, uint32_t index) {
+    EMIT(b, 0x49, 0x8b)
+    emit_address(b, reg, base, index);
+}
+
+// mov [base + index * 8], reg
+static void emit_store(Buffer *b, int reg, int base, uint32_t index) {
+    EMIT(b, 0x49, 0x89)
+    emit_address(b, reg, base, index);
+}
+
+static void emit_mov_rax(Buffer *b, uint64_t n) {
+    EMIT(b, 0x48, 0xb8) // mov rax, imm64
+    emit_u64(b, n);
+}
+
+static void emit_drop(Buffer *b, uint32_t n) {
+    EMIT(b, 0x49, 0x81, 0xec) // sub r12, imm32
+    emit_u32(b, n * sizeof(Value));
+}
+
+// Calls fn(sp, ...) with its other arguments already set, taking its new sp
+static void emit_helper(Buffer *b, const void *fn) {
+    EMIT(b, 0x4c, 0x89, 0xe7) // mov rdi, r12
+    emit_mov_rax(b, (uintptr_t) fn);
+    EMIT(b, 0xff, 0xd0) // call rax
+    EMIT(b, 0x49, 0x89, 0xc4) // mov r12, rax
+}
+
+static void emit_arg_u64(Buffer *b, uint64_t n) {
+    EMIT(b, 0x48, 0xbe) // mov rsi, imm64
+    emit_u64(b, n);
+}
+
+static void emit_arg_u32(Buffer *b, uint32_t n) {
+    EMIT(b, 0xbe) // mov esi, imm32
+    emit_u32(b, n);
+}
+
+static Reg_Kind reg_kind(uint32_t operand) {
+    return operand & ((1 << REG_KIND_BITS) - 1);
+}
+
+// Base register holding the values a register operand of kind indexes
+static int reg_base(Reg_Kind kind) {
+    switch (kind) {
+    case REG_LOCAL: return LOCALS;
+    case REG_GLOBAL: return GLOBALS;
+    case REG_TEMP: return STACK;
+    default: return REGISTERS;
+    }
+}
+
+// Loads a register instruction operand that isn't on the stack into rax
+static void emit_reg_operand(Buffer *b, uint32_t operand) {
+    uint32_t index = operand >> REG_KIND_BITS;
+    if (reg_kind(operand) == REG_IMM) {
+        emit_mov_rax(b,
+            from_double((int32_t) (index >> 1) ^ -(int32_t) (index & 1)).bits);
+    } else {
+        emit_load(b, RAX, reg_base(reg_kind(operand)), index);
+    }
+}
+
+/* Register instructions are run as their stack form, with the operands that
+ * aren't on the stack pushed in place and the result stored from the top.
+ */
+static void emit_reg_instr(Buffer *b, const uint32_t *operands, const void *fn) {
+    uint32_t dest = operands[0], lhs = operands[1], rhs = operands[2];
+    if (reg_kind(lhs) != REG_STACK && reg_kind(rhs) == REG_STACK) {
+        // The left operand goes under the right one already on the stack
+        EMIT(b, 0x49, 0x8b, 0x4c, 0x24, 0xf8) // mov rcx, [r12 - 8]
+        emit_reg_operand(b, lhs);
+        EMIT(b, 0x49, 0x89, 0x44, 0x24, 0xf8) // mov [r12 - 8], rax
+        EMIT(b, 0x49, 0x89, 0x0c, 0x24) // mov [r12], rcx
+        EMIT(b, 0x49, 0x83, 0xc4, 0x08) // add r12, 8
+    } else if (reg_kind(lhs) != REG_STACK) {
+        // Both are read before either is pushed over a temporary
+        emit_reg_operand(b, rhs);
+        EMIT(b, 0x48, 0x89, 0xc1) // mov rcx, rax
+        emit_reg_operand(b, lhs);
+        EMIT(b, 0x49, 0x89, 0x04, 0x24) // mov [r12], rax
+        EMIT(b, 0x49, 0x89, 0x4c, 0x24, 0x08) // mov [r12 + 8], rcx
+        EMIT(b, 0x49, 0x83, 0xc4, 0x10) // add r12, 16
+    } else if (reg_kind(rhs) != REG_STACK) {
+        emit_reg_operand(b, rhs);
+        emit_push_rax(b);
+    }
+    emit_helper(b, fn);
+    if (reg_kind(dest) != REG_STACK) {
+        emit_pop_rax(b);
+        emit_store(b, RAX, reg_base(reg_kind(dest)), dest >> REG_KIND_BITS);
+    }
+}
+
+// Placeholder rel32 to be pointed at the native code of ip
+typedef struct {
+    size_t at;
+    size_t ip;
+} Fixup;
+
+// Returns to the interpreter, which resumes at ip
+static void emit_exit(Buffer *b, size_t ip, size_t epilogue) {
+    EMIT(b, 0xb8) // mov eax, imm32
+    emit_u32(b, ip);
+    EMIT(b, 0xe9) // jmp rel32
+    emit_u32(b, epilogue - (b->length + 4));
+}
+
+static void emit_jump(Buffer *b, Fixup **fixups, size_t *num_fixups, size_t ip) {
+    *fixups = realloc(*fixups, (*num_fixups + 1) * sizeof(Fixup));
+    (*fixups)[(*num_fixups)++] = (Fixup) { b->length, ip };
+    emit_u32(b, 0);
+}
+
+static int is_terminator(Opcode op) {
+    return op == RET || op == TAIL_CALL || op == JMP || op == HALT;
+}
+
+// Translates the lambda at f->entry, returning 0 if it can't be
+static int compile_function(Jit_Function *f, const Code *code) {
+    // The lambda ends at the first terminator no forward jump goes past
+    size_t end = f->entry;
+    size_t furthest = f->entry;
+    while (end < code->length) {
+        const uint8_t *pc = code->bytes + end;
+        Opcode op = *pc++;
+        uint32_t operand = 0;
+        for (int i = 0; i < num_ops(op); i++) {
+            uint32_t n = read_uint(&pc);
+            if (i == 0) operand = n;
+        }
+        if ((op == JMP || op == JE || op == JNE) && operand > furthest) {
+            furthest = operand;
+        }
+        end = pc - code->bytes;
+        if (is_terminator(op) && end > furthest) break;
+    }
+    if (end > code->length || end - f->entry > UINT16_MAX) return 0;
+
+    f->start = f->entry;
+    f->end = end;
+    f->offsets = calloc(end - f->start, sizeof(uint32_t));
+    Buffer b = { 0, 0, 0 };
+    Fixup *fixups = 0;
+    size_t num_fixups = 0;
+
+    // Entered with the Jit_Regs and the instruction to start at
+    EMIT(&b,
+        0x53, // push rbx
+        0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push r12-r15
+        0x48, 0x89, 0xfb, // mov rbx, rdi
+        0x4c, 0x8b, 0x23, // mov r12, [rbx]
+        0x4c, 0x8b, 0x6b, 0x08, // mov r13, [rbx + 8]
+        0x4c, 0x8b, 0x73, 0x10, // mov r14, [rbx + 16]
+        0x4c, 0x8b, 0x7b, 0x18, // mov r15, [rbx + 24]
+        0xff, 0xe6) // jmp rsi
+    // Exits come here with the ip to resume at in eax
+    size_t epilogue = b.length;
+    EMIT(&b,
+        0x4c, 0x89, 0x23, // mov [rbx], r12
+        0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, // pop r15-r12
+        0x5b, // pop rbx
+        0xc3) // ret
+
+    const Value *consts = code->consts;
+    size_t ip = f->start;
+    while (ip < end) {
+        const uint8_t *pc = code->bytes + ip;
+        Opcode op = *pc++;
+        uint32_t operands[3] = { 0 };
+        for (int i = 0; i < num_ops(op); i++) operands[i] = read_uint(&pc);
+        size_t next = pc - code->bytes;
+        f->offsets[ip - f->start] = b.length;
+
+        switch (op) {
+        case PUSH:
+            emit_mov_rax(&b, consts[operands[0]].bits);
+            emit_push_rax(&b);
+            break;
+        case PUSH_INT:
+            pc = code->bytes + ip + 1;
+            emit_mov_rax(&b, from_double(read_int(&pc)).bits);
+            emit_push_rax(&b);
+            break;
+        case PUSH_0:
+            emit_mov_rax(&b, from_double(0).bits);
+            emit_push_rax(&b);
+            break;
+        case POP:
+            emit_drop(&b, 1);
+            break;
+        case POPN:
+            emit_drop(&b, operands[0]);
+            break;
+        case POPN_KEEP:
+            emit_pop_rax(&b);
+            emit_drop(&b, operands[0]);
+            emit_push_rax(&b);
+            break;
+        case DUP:
+            EMIT(&b, 0x49, 0x8b, 0x44, 0x24, 0xf8) // mov rax, [r12 - 8]
+            emit_push_rax(&b);
+            break;
+        case LOAD:
+            emit_load(&b, RAX, LOCALS, operands[0]);
+            emit_push_rax(&b);
+            break;
+        case STORE:
+            emit_pop_rax(&b);
+            emit_store(&b, RAX, LOCALS, operands[0]);
+            break;
+        case GLOAD:
+            emit_load(&b, RAX, GLOBALS, operands[0]);
+            emit_push_rax(&b);
+            break;
+        case GSTORE:
+            emit_pop_rax(&b);
+            emit_store(&b, RAX, GLOBALS, operands[0]);
+            break;
+        case LOAD_REG:
+        case PUSRET:
+            emit_load(&b, RAX, REGISTERS, op == PUSRET ? RET_VAL : operands[0]);
+            emit_push_rax(&b);
+            break;
+        case STO_REG:
+        case STORET:
+            emit_pop_rax(&b);
+            emit_store(&b, RAX, REGISTERS, op == STORET ? RET_VAL : operands[0]);
+            break;
+        case MOV_REG:
+            emit_load(&b, RAX, REGISTERS, operands[0]);
+            emit_store(&b, RAX, REGISTERS, operands[1]);
+            break;
+        case SWAP_REG:
+            emit_load(&b, RAX, REGISTERS, operands[0]);
+            emit_load(&b, RCX, REGISTERS, operands[1]);
+            emit_store(&b, RCX, REGISTERS, operands[0]);
+            emit_store(&b, RAX, REGISTERS, operands[1]);
+            break;
+        case LOAD_DEFAULT_VAL: {
+            Ang_Type *type = get_ptr(consts[operands[0]]);
+            emit_mov_rax(&b, (uintptr_t) &type->default_value);
+            EMIT(&b, 0x48, 0x8b, 0x00) // mov rax, [rax]
+            emit_push_rax(&b);
+            break;
+        }
+        // Backward jumps go back to the interpreter for its safepoint
+        case JMP:
+            if (operands[0] <= ip) {
+                emit_exit(&b, ip, epilogue);
+                break;
+            }
+            EMIT(&b, 0xe9) // jmp rel32
+            emit_jump(&b, &fixups, &num_fixups, operands[0]);
+            break;
+        case JE:
+        case JNE:
+            if (operands[0] <= ip) {
+                emit_exit(&b, ip, epilogue);
+                break;
+            }
+            emit_pop_rax(&b);
+            EMIT(&b, 0x48, 0xb9) // mov rcx, imm64
+            emit_u64(&b, op == JE ? true_val.bits : false_val.bits);
+            EMIT(&b, 0x48, 0x39, 0xc8) // cmp rax, rcx
+            EMIT(&b, 0x0f, 0x84) // je rel32
+            emit_jump(&b, &fixups, &num_fixups, operands[0]);
+            break;
+        case ADD: emit_helper(&b, add); break;
+        case SUB: emit_helper(&b, sub); break;
+        case MUL: emit_helper(&b, mul); break;
+        case ADDF: emit_helper(&b, addf); break;
+        case SUBF: emit_helper(&b, subf); break;
+        case MULF: emit_helper(&b, mulf); break;
+        case DIVF: emit_helper(&b, divf); break;
+        case LT: emit_helper(&b, lt); break;
+        case LE: emit_helper(&b, le); break;
+        case GT: emit_helper(&b, gt); break;
+        case GE: emit_helper(&b, ge); break;
+        case EQ_NUM: emit_helper(&b, eq_num); break;
+        case NE_NUM: emit_helper(&b, ne_num); break;
+        case EQ: emit_helper(&b, eq); break;
+        case NEG: emit_helper(&b, neg); break;
+        case LOAD_SLOT:
+            emit_arg_u32(&b, operands[0]);
+            emit_helper(&b, load_slot);
+            break;
+        case UNPACK_TUPLE:
+            emit_arg_u32(&b, operands[0]);
+            emit_helper(&b, unpack_tuple);
+            break;
+        case CMP_NUM:
+        case CMP_BOOL:
+        case CMP_NULL:
+        case CMP_STRING:
+            emit_arg_u64(&b, consts[operands[0]].bits);
+            emit_helper(&b, op == CMP_NUM ? (void *) cmp_num
+                : op == CMP_BOOL ? (void *) cmp_bool
+                : op == CMP_NULL ? (void *) cmp_null
+                : (void *) cmp_string);
+            break;
+        case ADD_R: emit_reg_instr(&b, operands, add); break;
+        case SUB_R: emit_reg_instr(&b, operands, sub); break;
+        case MUL_R: emit_reg_instr(&b, operands, mul); break;
+        case ADDF_R: emit_reg_instr(&b, operands, addf); break;
+        case SUBF_R: emit_reg_instr(&b, operands, subf); break;
+        case MULF_R: emit_reg_instr(&b, operands, mulf); break;
+        case DIVF_R: emit_reg_instr(&b, operands, divf); break;
+        case LT_R: emit_reg_instr(&b, operands, lt); break;
+        case LE_R: emit_reg_instr(&b, operands, le); break;
+        case GT_R: emit_reg_instr(&b, operands, gt); break;
+        case GE_R: emit_reg_instr(&b, operands, ge); break;
+        case EQ_R: emit_reg_instr(&b, operands, eq); break;
+        case NE_R: emit_reg_instr(&b, operands, ne); break;
+        // Everything that allocates, calls, returns or may quicken
+        default:
+            emit_exit(&b, ip, epilogue);
+            break;
+        }
+        ip = next;
+    }
+    emit_exit(&b, end, epilogue);
+
+    // Jumps out of the lambda leave through exits of their own
+    for (size_t i = 0; i < num_fixups; i++) {
+        size_t target = fixups[i].ip;
+        size_t to;
+        if (target >= f->start && target < end && f->offsets[target - f->start]) {
+            to = f->offsets[target - f->start];
+        } else {
+            to = b.length;
+            emit_exit(&b, target, epilogue);
+        }
+        uint32_t rel = to - (fixups[i].at + 4);
+        memcpy(b.bytes + fixups[i].at, &rel, sizeof(rel));
+    }
+    free(fixups);
+
+    f->native_size = b.length;
+    void *native = mmap(0, b.length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (native == MAP_FAILED) {
+        free(b.bytes);
+        return 0;
+    }
+    memcpy(native, b.bytes, b.length);
+    free(b.bytes);
+    if (mprotect(native, f->native_size, PROT_READ | PROT_EXEC)) {
+        munmap(native, f->native_size);
+        return 0;
+    }
+    f->native = native;
+    return 1;
+}
+
+#undef EMIT
+
+#else
+
+static void free_function(Jit_Function *f) {
+    free(f->offsets);
+    free(f);
+}
+
+size_t jit_run(const Jit_Function *f, const void *target, Memory *mem) {
+    (void) target;
+    (void) mem;
+    return f->entry;
+}
+
+static int compile_function(Jit_Function *f, const Code *code) {
+    (void) f;
+    (void) code;
+    return 0;
+}
+
+#endif // ANG_JIT
+
+const Jit_Function *jit_call(Jit *jit, const Code *code, size_t entry) {
+    size_t i = function_index(jit, entry);
+    if (i == jit->num_functions || jit->functions[i]->entry != entry) {
+        jit->functions = realloc(jit->functions,
+            (jit->num_functions + 1) * sizeof(Jit_Function *));
+        memmove(jit->functions + i + 1, jit->functions + i,
+            (jit->num_functions - i) * sizeof(Jit_Function *));
+        jit->num_functions++;
+        jit->functions[i] = calloc(1, sizeof(Jit_Function));
+        jit->functions[i]->entry = entry;
+    }
+    Jit_Function *f = jit->functions[i];
+    if (f->native) return f;
+    if (f->failed || ++f->calls < JIT_THRESHOLD) return 0;
+    if (!compile_function(f, code)) {
+        f->failed = 1;
+        free(f->offsets);
+        f->offsets = 0;
+        return 0;
+    }
+    return f;
+}
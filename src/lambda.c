@@ -1,10 +1,11 @@
 #include "lambda.h"
 
-void save_lambda_env(Lambda *l, const Memory *mem) {
-    l->nenv = mem->sp - mem->fp;
-    l->env = calloc(l->nenv, sizeof(Value));
-    for (int i = 0; i < l->nenv; i++) {
-        l->env[i] = mem->stack[mem->fp + i];
+void save_lambda_env(Lambda *l, Memory *mem, int nenv) {
+    l->nenv = nenv;
+    l->env = nenv ? mem_alloc(mem, nenv * sizeof(Value)) : 0;
+    mem->sp -= nenv;
+    for (int i = 0; i < nenv; i++) {
+        l->env[i] = mem->stack[mem->sp + i];
     }
 }
 
@@ -14,6 +15,6 @@ void load_lambda_env(const Lambda *l, Memory *mem) {
     }
 }
 
-void destroy_lambda(Lambda *l) {
-    free(l->env);
+void destroy_lambda(Lambda *l, Memory *mem) {
+    mem_free(mem, l->env, l->nenv * sizeof(Value));
 }
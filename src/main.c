@@ -7,6 +7,9 @@
 #include "ang_type.h"
 #include "compiler.h"
 #include "ang_primitives.h"
+#include "emit_c.h"
+#include "mark.h"
+#include "sweeper.h"
 
 static char *get_line(void) {
     char * line = malloc(100), * linep = line;
@@ -53,23 +56,37 @@ static char *read_file(const char *file_path) {
     return file_contents;
 }
 
-void run_script(char *file_path) {
+typedef struct {
+    char *script;
+    int reg_vm;
+    int jit;
+    int emit_c; // Write the script out as C instead of running it
+    size_t stack_size;
+    size_t max_stack_size;
+    size_t budget;
+    size_t time_limit; // In milliseconds
+    size_t mark_threads;
+    int sweep_thread;
+} Options;
+
+void run_script(const Options *opts) {
     Ang_VM vm;
-    ctor_ang_vm(&vm, 100);
+    ctor_ang_vm(&vm, 100, opts->stack_size, opts->max_stack_size);
+    vm.compiler.reg_vm = opts->reg_vm;
+    vm.jit.enabled = opts->jit;
+    vm.budget = opts->budget;
+    vm.time_limit = opts->time_limit / 1000.0;
+    vm.mem.mark_pool = start_mark_pool(opts->mark_threads);
+    if (opts->sweep_thread) vm.mem.sweeper = start_sweeper();
     #ifdef DEBUG
     vm.trace = 1;
     #endif
     Primitive_Types defaults;
     ctor_primitive_types(&defaults);
-    set_hashtable(&vm.compiler.env.types, "Und", from_ptr(&defaults.und_default));
-    set_hashtable(&vm.compiler.env.types, "Any", from_ptr(&defaults.und_default));
-    set_hashtable(&vm.compiler.env.types, "Num", from_ptr(&defaults.num_default));
-    set_hashtable(&vm.compiler.env.types, "Bool", from_ptr(&defaults.bool_default));
-    set_hashtable(&vm.compiler.env.types, "String", from_ptr(&defaults.string_default));
-    set_hashtable(&vm.compiler.env.types, "Null", from_ptr(&defaults.null_default));
-
-    char *file_contents = read_file(file_path);
-    run_code(&vm, file_contents, file_path);
+    add_primitive_types(&vm, &defaults);
+
+    char *file_contents = read_file(opts->script);
+    run_code(&vm, file_contents, opts->script);
     free(file_contents);
 
     dtor_ang_vm(&vm);
@@ -77,20 +94,47 @@ void run_script(char *file_path) {
     return;
 }
 
-void run_repl() {
+int emit_script(const Options *opts) {
+    Ang_VM vm;
+    ctor_ang_vm(&vm, 100, opts->stack_size, opts->max_stack_size);
+    vm.compiler.reg_vm = opts->reg_vm;
+    Primitive_Types defaults;
+    ctor_primitive_types(&defaults);
+    add_primitive_types(&vm, &defaults);
+
+    char *file_contents = read_file(opts->script);
+    load_script(&vm, file_contents, opts->script);
+    int ok = !vm.enc_err;
+    if (ok && !emit_c(&vm, file_contents, opts->script, stdout)) {
+        fprintf(stderr,
+            "%s doesn't verify or has instructions without a C translation\n",
+            opts->script);
+        ok = 0;
+    }
+    free(file_contents);
+
+    dtor_ang_vm(&vm);
+    dtor_primitive_types(&defaults);
+    return ok;
+}
+
+void run_repl(const Options *opts) {
     Ang_VM vm;
-    ctor_ang_vm(&vm, 100);
+    ctor_ang_vm(&vm, 100, opts->stack_size, opts->max_stack_size);
+    vm.compiler.reg_vm = opts->reg_vm;
+    vm.jit.enabled = opts->jit;
+    vm.budget = opts->budget;
+    vm.time_limit = opts->time_limit / 1000.0;
+    vm.mem.mark_pool = start_mark_pool(opts->mark_threads);
+    if (opts->sweep_thread) vm.mem.sweeper = start_sweeper();
     #ifdef DEBUG
     vm.trace = 1;
     #endif
     Primitive_Types defaults;
     ctor_primitive_types(&defaults);
-    set_hashtable(&vm.compiler.env.types, "Und", from_ptr(&defaults.und_default));
+    add_primitive_types(&vm, &defaults);
+    // Unlike in scripts, Any is a type of its own in the repl
     set_hashtable(&vm.compiler.env.types, "Any", from_ptr(&defaults.any_default));
-    set_hashtable(&vm.compiler.env.types, "Num", from_ptr(&defaults.num_default));
-    set_hashtable(&vm.compiler.env.types, "Bool", from_ptr(&defaults.bool_default));
-    set_hashtable(&vm.compiler.env.types, "String", from_ptr(&defaults.string_default));
-    set_hashtable(&vm.compiler.env.types, "Null", from_ptr(&defaults.null_default));
     char *expr;
     for (;;) {
         printf("> ");
@@ -113,13 +157,71 @@ void run_repl() {
     dtor_primitive_types(&defaults);
 }
 
+// Reads the size following a flag, returning 0 if there isn't a valid one
+static size_t parse_size(int argc, char *argv[], int *i) {
+    if (++*i >= argc) return 0;
+    char *end;
+    unsigned long size = strtoul(argv[*i], &end, 10);
+    return *end ? 0 : size;
+}
+
+static int parse_options(Options *opts, int argc, char *argv[]) {
+    opts->script = 0;
+    opts->reg_vm = 0;
+    opts->jit = 0;
+    opts->emit_c = 0;
+    opts->stack_size = DEFAULT_STACK_SIZE;
+    opts->max_stack_size = DEFAULT_MAX_STACK_SIZE;
+    opts->budget = 0;
+    opts->time_limit = 0;
+    opts->mark_threads = 1;
+    opts->sweep_thread = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reg") == 0) {
+            opts->reg_vm = 1;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            opts->jit = 1;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            opts->emit_c = 1;
+        } else if (strcmp(argv[i], "--stack-size") == 0) {
+            opts->stack_size = parse_size(argc, argv, &i);
+            if (!opts->stack_size) return 0;
+        } else if (strcmp(argv[i], "--max-stack-size") == 0) {
+            opts->max_stack_size = parse_size(argc, argv, &i);
+            if (!opts->max_stack_size) return 0;
+        } else if (strcmp(argv[i], "--budget") == 0) {
+            opts->budget = parse_size(argc, argv, &i);
+            if (!opts->budget) return 0;
+        } else if (strcmp(argv[i], "--time-limit") == 0) {
+            opts->time_limit = parse_size(argc, argv, &i);
+            if (!opts->time_limit) return 0;
+        } else if (strcmp(argv[i], "--mark-threads") == 0) {
+            opts->mark_threads = parse_size(argc, argv, &i);
+            if (!opts->mark_threads) return 0;
+        } else if (strcmp(argv[i], "--sweep-thread") == 0) {
+            opts->sweep_thread = 1;
+        } else if (argv[i][0] == '-' || opts->script) {
+            return 0;
+        } else {
+            opts->script = argv[i];
+        }
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc > 2) {
-        puts("Usage: angstrom [script]");
-    } else if (argc == 2) {
-        run_script(argv[1]);
+    Options opts;
+    if (!parse_options(&opts, argc, argv)) {
+        puts("Usage: angstrom [--reg] [--jit] [--stack-size n] "
+            "[--max-stack-size n] [--budget n] [--time-limit ms]\n"
+            "                [--mark-threads n] [--sweep-thread] [script]\n"
+            "       angstrom [--reg] --emit-c script > program.c");
+    } else if (opts.emit_c) {
+        if (!opts.script || !emit_script(&opts)) return 1;
+    } else if (opts.script) {
+        run_script(&opts);
     } else {
-        run_repl();
+        run_repl(&opts);
     }
 
     return 0;
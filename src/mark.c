@@ -0,0 +1,238 @@
+#define _DEFAULT_SOURCE // pthreads aren't part of C99
+#include "mark.h"
+
+#ifdef ANG_MARK_THREADS
+#include <pthread.h>
+#include <stdlib.h>
+
+// Objects a marker scans between checks for idle markers to share with
+#define SHARE_INTERVAL 64
+
+typedef struct {
+    Mark_Pool *pool;
+    Mark_Stack gray; // Only used by the marker's thread
+    Mark_Stack shared; // Gray objects others can steal, behind the pool's lock
+    size_t first_root, end_root;
+} Marker;
+
+struct Mark_Pool {
+    Memory *mem; // Being marked in the current pause
+    Marker markers[MAX_MARK_THREADS]; // The first runs on the pausing thread
+    pthread_t threads[MAX_MARK_THREADS];
+    size_t num_markers;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Gray objects were shared or every marker is idle
+    pthread_cond_t start; // A pause began or the pool is stopping
+    pthread_cond_t done; // A marker finished its part of the pause
+    size_t idle; // Markers waiting for work
+    size_t pauses; // Pauses begun, for markers to tell a new one from the last
+    size_t finished; // Markers done with the current pause
+    int stopping;
+};
+
+// The ith of mem's roots, counting the stack, globals, registers and frames
+static Value root_at(const Memory *mem, size_t i) {
+    if (i < (size_t) mem->sp) return mem->stack[i];
+    i -= mem->sp;
+    if (i < mem->global_size) return mem->gmem[i];
+    i -= mem->global_size;
+    if (i < NUM_REGISTERS) return mem->registers[i];
+    i -= NUM_REGISTERS;
+    if (i < mem->num_frames) return from_ptr(mem->frames[i].closure);
+    i -= mem->num_frames;
+    return *mem->roots[i];
+}
+
+static size_t count_roots(const Memory *mem) {
+    return mem->sp + mem->global_size + NUM_REGISTERS + mem->num_frames
+        + mem->num_roots;
+}
+
+// Other markers may race to mark the same object, only one of them scans it
+static Value mark_shared(Value v, void *arg) {
+    Marker *m = arg;
+    Ang_Obj *obj = get_ptr(v);
+    if (obj && !__atomic_load_n(&obj->marked, __ATOMIC_RELAXED)
+            && !__atomic_exchange_n(&obj->marked, 1, __ATOMIC_RELAXED)) {
+        push_mark_stack(&m->gray, obj);
+    }
+    return v;
+}
+
+// Hands half of m's gray objects over to be stolen
+static void share(Marker *m) {
+    Mark_Pool *pool = m->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (!m->shared.length) {
+        for (size_t n = m->gray.length / 2; n > 0; n--) {
+            push_mark_stack(&m->shared, m->gray.objs[--m->gray.length]);
+        }
+        pthread_cond_broadcast(&pool->work);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for gray objects to steal, returning 0 once every marker is out
+static int steal(Marker *m) {
+    Mark_Pool *pool = m->pool;
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        for (size_t i = 0; i < pool->num_markers; i++) {
+            Mark_Stack *victim = &pool->markers[i].shared;
+            if (!victim->length) continue;
+            for (size_t n = (victim->length + 1) / 2; n > 0; n--) {
+                push_mark_stack(&m->gray, victim->objs[--victim->length]);
+            }
+            __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&pool->lock);
+            return 1;
+        }
+        if (pool->idle == pool->num_markers) {
+            pthread_cond_broadcast(&pool->work);
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        pthread_cond_wait(&pool->work, &pool->lock);
+    }
+}
+
+static void mark_roots(Marker *m, size_t first, size_t end) {
+    for (size_t i = first; i < end; i++) {
+        Value v = root_at(m->pool->mem, i);
+        if (is_ptr(v)) mark_shared(v, m);
+    }
+}
+
+static void run_marker(Marker *m) {
+    mark_roots(m, m->first_root, m->end_root);
+    do {
+        size_t scanned = 0;
+        while (m->gray.length) {
+            visit_ang_obj(m->gray.objs[--m->gray.length], mark_shared, m);
+            if (++scanned % SHARE_INTERVAL == 0 && m->gray.length > 1
+                    && __atomic_load_n(&m->pool->idle, __ATOMIC_RELAXED)) {
+                share(m);
+            }
+        }
+    } while (steal(m));
+}
+
+// Marks along with the pausing thread for every pause until the pool stops
+static void *run_pool_marker(void *arg) {
+    Marker *m = arg;
+    Mark_Pool *pool = m->pool;
+    size_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->pauses == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) break;
+        seen = pool->pauses;
+        pthread_mutex_unlock(&pool->lock);
+        run_marker(m);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+Mark_Pool *start_mark_pool(size_t num_markers) {
+    if (num_markers > MAX_MARK_THREADS) num_markers = MAX_MARK_THREADS;
+    if (num_markers <= 1) return 0;
+    Mark_Pool *pool = calloc(1, sizeof(Mark_Pool));
+    pthread_mutex_init(&pool->lock, 0);
+    pthread_cond_init(&pool->work, 0);
+    pthread_cond_init(&pool->start, 0);
+    pthread_cond_init(&pool->done, 0);
+    for (size_t i = 0; i < num_markers; i++) {
+        pool->markers[i].pool = pool;
+        ctor_mark_stack(&pool->markers[i].gray);
+        ctor_mark_stack(&pool->markers[i].shared);
+    }
+    // The pool makes do with the markers whose threads start
+    pool->num_markers = 1;
+    while (pool->num_markers < num_markers
+            && !pthread_create(&pool->threads[pool->num_markers], 0,
+                run_pool_marker, &pool->markers[pool->num_markers])) {
+        pool->num_markers++;
+    }
+    for (size_t i = pool->num_markers; i < num_markers; i++) {
+        dtor_mark_stack(&pool->markers[i].gray);
+        dtor_mark_stack(&pool->markers[i].shared);
+    }
+    if (pool->num_markers == 1) {
+        stop_mark_pool(pool);
+        return 0;
+    }
+    return pool;
+}
+
+void stop_mark_pool(Mark_Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->num_markers; i++) {
+        pthread_join(pool->threads[i], 0);
+    }
+    for (size_t i = 0; i < pool->num_markers; i++) {
+        dtor_mark_stack(&pool->markers[i].gray);
+        dtor_mark_stack(&pool->markers[i].shared);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void parallel_mark(Memory *mem) {
+    Mark_Pool *pool = mem->mark_pool;
+    if (!pool) {
+        mark_all_objects(mem);
+        mark_gray(mem, SIZE_MAX);
+        return;
+    }
+    size_t n = pool->num_markers;
+    size_t roots = count_roots(mem);
+    for (size_t i = 0; i < n; i++) {
+        pool->markers[i].first_root = roots * i / n;
+        pool->markers[i].end_root = roots * (i + 1) / n;
+    }
+    // Objects left gray by incremental marking are dealt out too
+    for (size_t i = 0; i < mem->gray.length; i++) {
+        push_mark_stack(&pool->markers[i % n].gray, mem->gray.objs[i]);
+    }
+    mem->gray.length = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->mem = mem;
+    pool->idle = 0;
+    pool->finished = 0;
+    pool->pauses++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    run_marker(&pool->markers[0]);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < n - 1) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#else
+
+Mark_Pool *start_mark_pool(size_t num_markers) {
+    return 0;
+}
+
+void stop_mark_pool(Mark_Pool *pool) {}
+
+void parallel_mark(Memory *mem) {
+    mark_all_objects(mem);
+    mark_gray(mem, SIZE_MAX);
+}
+
+#endif // ANG_MARK_THREADS
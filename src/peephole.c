@@ -0,0 +1,114 @@
+#include "peephole.h"
+
+#include "ang_opcodes.h"
+#include "ang_code.h"
+
+#define MAX_PATTERN 3
+#define REMOVE -1
+
+typedef struct {
+    Opcode pattern[MAX_PATTERN];
+    int length;
+    int replacement;
+} Peephole_Rule;
+
+/* Longer sequences come first so they win over their prefixes. Operands of
+ * the matched instructions are carried over to the replacement in order.
+ */
+static const Peephole_Rule rules[] = {
+    { { STORET, POPN, PUSRET }, 3, POPN_KEEP },
+    { { STORET, PUSRET }, 2, REMOVE },
+    { { PUSH, LOAD_TUPLE }, 2, LOAD_SLOT },
+};
+
+#define NUM_RULES (sizeof(rules) / sizeof(Peephole_Rule))
+
+static int rule_matches(const Peephole_Rule *rule,
+        const List *instr,
+        size_t i,
+        const char *is_target) {
+    for (int j = 0; j < rule->length; j++) {
+        if (i >= instr->length) return 0;
+        Opcode op = access_list(instr, i).as_int32;
+        if (op != rule->pattern[j]) return 0;
+        // Control may only enter the sequence at its first instruction
+        if (j > 0 && is_target[i]) return 0;
+        // Slot numbers are the only PUSH operands that can be fused
+        if (op == PUSH && !is_int32(access_list(instr, i + 1))) return 0;
+        i += 1 + num_ops(op);
+    }
+    return 1;
+}
+
+void optimize_instr(List *instr, size_t start) {
+    size_t n = instr->length - start;
+    char *is_target = calloc(instr->length + 1, sizeof(char));
+    size_t *new_loc = calloc(n + 1, sizeof(size_t));
+
+    size_t i = start;
+    while (i < instr->length) {
+        Opcode op = access_list(instr, i).as_int32;
+        for (int j = 0; j < num_ops(op); j++) {
+            if (operand_kind(op, j) != OPERAND_ADDR) continue;
+            size_t target = access_list(instr, i + 1 + j).as_int32;
+            if (target >= start && target <= instr->length) is_target[target] = 1;
+        }
+        i += 1 + num_ops(op);
+    }
+
+    List optimized;
+    ctor_list(&optimized);
+    i = start;
+    while (i < instr->length) {
+        new_loc[i - start] = start + optimized.length;
+        const Peephole_Rule *rule = 0;
+        for (size_t r = 0; r < NUM_RULES; r++) {
+            if (rule_matches(&rules[r], instr, i, is_target)) {
+                rule = &rules[r];
+                break;
+            }
+        }
+        if (!rule) {
+            Opcode op = access_list(instr, i).as_int32;
+            for (int j = 0; j <= num_ops(op); j++) {
+                append_list(&optimized, access_list(instr, i + j));
+            }
+            i += 1 + num_ops(op);
+            continue;
+        }
+        if (rule->replacement != REMOVE) {
+            append_list(&optimized, from_double(rule->replacement));
+        }
+        for (int j = 0; j < rule->length; j++) {
+            Opcode op = access_list(instr, i).as_int32;
+            for (int k = 1; k <= num_ops(op); k++) {
+                append_list(&optimized, access_list(instr, i + k));
+            }
+            i += 1 + num_ops(op);
+        }
+    }
+    new_loc[n] = start + optimized.length;
+
+    // Relocate addresses, which only point at instruction starts
+    i = 0;
+    while (i < optimized.length) {
+        Opcode op = access_list(&optimized, i).as_int32;
+        for (int j = 0; j < num_ops(op); j++) {
+            if (operand_kind(op, j) != OPERAND_ADDR) continue;
+            size_t target = access_list(&optimized, i + 1 + j).as_int32;
+            if (target < start || target > start + n) continue;
+            set_list(&optimized, i + 1 + j, from_double(new_loc[target - start]));
+        }
+        i += 1 + num_ops(op);
+    }
+
+    for (i = 0; i < optimized.length; i++) {
+        set_list(instr, start + i, access_list(&optimized, i));
+    }
+    while (instr->length > start + optimized.length) {
+        delete_list(instr, instr->length - 1);
+    }
+    dtor_list(&optimized);
+    free(new_loc);
+    free(is_target);
+}
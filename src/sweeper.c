@@ -0,0 +1,133 @@
+#define _DEFAULT_SOURCE // pthreads aren't part of C99
+#include "sweeper.h"
+
+#include <stdlib.h>
+
+#ifdef ANG_SWEEP_THREAD
+#include <pthread.h>
+
+typedef struct {
+    char *str; // Freed if set, otherwise list is destroyed
+    List list;
+} Garbage;
+
+typedef struct {
+    Garbage *items;
+    size_t length;
+    size_t capacity;
+} Garbage_List;
+
+struct Sweeper {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int stopping;
+    Garbage_List swept; // Only used by the mutator's thread
+    Garbage_List handed; // Waiting to be freed, behind the lock
+};
+
+static void push_garbage(Garbage_List *g, Garbage item) {
+    if (g->length == g->capacity) {
+        g->capacity = g->capacity ? g->capacity * 2 : 256;
+        g->items = realloc(g->items, g->capacity * sizeof(Garbage));
+    }
+    g->items[g->length++] = item;
+}
+
+static void *run_sweeper(void *arg) {
+    Sweeper *s = arg;
+    Garbage_List freeing = { 0, 0, 0 };
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->handed.length && !s->stopping) {
+            pthread_cond_wait(&s->work, &s->lock);
+        }
+        if (!s->handed.length) break;
+        Garbage_List handed = s->handed;
+        s->handed = freeing;
+        freeing = handed;
+        pthread_mutex_unlock(&s->lock);
+        for (size_t i = 0; i < freeing.length; i++) {
+            if (freeing.items[i].str) free(freeing.items[i].str);
+            else dtor_list(&freeing.items[i].list);
+        }
+        freeing.length = 0;
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    free(freeing.items);
+    return 0;
+}
+
+Sweeper *start_sweeper(void) {
+    Sweeper *s = calloc(1, sizeof(Sweeper));
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->work, 0);
+    if (pthread_create(&s->thread, 0, run_sweeper, s)) {
+        pthread_cond_destroy(&s->work);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return 0;
+    }
+    return s;
+}
+
+void stop_sweeper(Sweeper *s) {
+    flush_sweeper(s);
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, 0);
+    free(s->swept.items);
+    free(s->handed.items);
+    pthread_cond_destroy(&s->work);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+void sweep_string(Sweeper *s, char *str) {
+    push_garbage(&s->swept, (Garbage) { .str = str });
+}
+
+void sweep_list(Sweeper *s, List l) {
+    push_garbage(&s->swept, (Garbage) { .list = l });
+}
+
+void flush_sweeper(Sweeper *s) {
+    if (!s->swept.length) return;
+    pthread_mutex_lock(&s->lock);
+    if (!s->handed.length) {
+        // The sweeper is keeping up, so the lists trade places
+        Garbage_List handed = s->handed;
+        s->handed = s->swept;
+        s->swept = handed;
+    } else {
+        for (size_t i = 0; i < s->swept.length; i++) {
+            push_garbage(&s->handed, s->swept.items[i]);
+        }
+        s->swept.length = 0;
+    }
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+}
+
+#else
+
+Sweeper *start_sweeper(void) {
+    return 0;
+}
+
+void stop_sweeper(Sweeper *s) {}
+
+void sweep_string(Sweeper *s, char *str) {
+    free(str);
+}
+
+void sweep_list(Sweeper *s, List l) {
+    dtor_list(&l);
+}
+
+void flush_sweeper(Sweeper *s) {}
+
+#endif // ANG_SWEEP_THREAD
@@ -0,0 +1,299 @@
+#include "verifier.h"
+
+#include "ang_mem.h"
+
+#define UNKNOWN -1
+#define MAX_OPERANDS 3
+
+// Whether a register instruction operand lives on the stack
+static int on_stack(uint32_t operand) {
+    return (operand & ((1 << REG_KIND_BITS) - 1)) == REG_STACK;
+}
+
+// How deep a register instruction run at depth reaches with its temporaries
+static int temps_depth(const uint32_t *operands, int depth) {
+    int deepest = depth;
+    for (int i = 0; i < 3; i++) {
+        if ((operands[i] & ((1 << REG_KIND_BITS) - 1)) != REG_TEMP) continue;
+        int reach = depth + (int) (operands[i] >> REG_KIND_BITS) + 1;
+        if (reach > deepest) deepest = reach;
+    }
+    return deepest;
+}
+
+/* Sets how many values op pops and then pushes. Returns 0 for instructions
+ * whose effect isn't known, like the ones moving the frame pointer.
+ */
+static int stack_effect(Opcode op, const uint32_t *operands, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (op) {
+    case HALT:
+    case JMP:
+    case SWAP_REG:
+    case MOV_REG:
+        return 1;
+    case PUSH:
+    case PUSH_INT:
+    case PUSOBJ:
+    case PUSH_0:
+    case GLOAD:
+    case LOAD:
+    case PUSRET:
+    case LOAD_DEFAULT_VAL:
+    case LOAD_REG:
+        *pushes = 1;
+        return 1;
+    case POP:
+    case JE:
+    case JNE:
+    case GSTORE:
+    case STORE:
+    case STORET:
+    case SET_DEFAULT_VAL:
+    case SET_DEFAULT_VAL_RESOLVED:
+    case STO_REG:
+    case RET:
+        *pops = 1;
+        return 1;
+    case POPN:
+        *pops = operands[0];
+        return 1;
+    case NEG:
+    case CMP_TYPE:
+    case CMP_STRUCT:
+    case CMP_NUM:
+    case CMP_BOOL:
+    case CMP_NULL:
+    case CMP_STRING:
+    case LOAD_SLOT:
+        *pops = 1;
+        *pushes = 1;
+        return 1;
+    case DUP:
+        *pops = 1;
+        *pushes = 2;
+        return 1;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case ADDF:
+    case SUBF:
+    case MULF:
+    case DIVF:
+    case LT:
+    case LE:
+    case GT:
+    case GE:
+    case EQ_NUM:
+    case NE_NUM:
+    case EQ:
+    case LOAD_TUPLE:
+    case ACCESS_ARR:
+    case CALL:
+        *pops = 2;
+        *pushes = 1;
+        return 1;
+    case TAIL_CALL:
+        *pops = 2;
+        return 1;
+    case SET_ARR:
+        *pops = 3;
+        *pushes = 1;
+        return 1;
+    case MAKE_TUPLE:
+    case CONS_ARR:
+        *pops = operands[1];
+        *pushes = 1;
+        return 1;
+    case UNPACK_TUPLE:
+        *pops = 1;
+        *pushes = operands[0];
+        return 1;
+    case CONS_LAMBDA:
+        *pops = operands[2];
+        *pushes = 1;
+        return 1;
+    case POPN_KEEP:
+        *pops = operands[0] + 1;
+        *pushes = 1;
+        return 1;
+    case ADD_R:
+    case SUB_R:
+    case MUL_R:
+    case ADDF_R:
+    case SUBF_R:
+    case MULF_R:
+    case DIVF_R:
+    case LT_R:
+    case LE_R:
+    case GT_R:
+    case GE_R:
+    case EQ_R:
+    case NE_R:
+        *pops = on_stack(operands[1]) + on_stack(operands[2]);
+        *pushes = on_stack(operands[0]);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Decodes the raw operands of the instruction at pc, returning its length
+static size_t decode(const uint8_t *pc, uint32_t *operands) {
+    const uint8_t *start = pc;
+    Opcode op = *pc++;
+    for (int i = 0; i < num_ops(op) && i < MAX_OPERANDS; i++) {
+        operands[i] = read_uint(&pc);
+    }
+    return pc - start;
+}
+
+typedef struct {
+    const Code *code;
+    size_t start;
+    size_t n; // Bytes being verified, offsets are relative to start
+    int *depth;
+    char *boundary;
+    size_t *work;
+    size_t num_work;
+} Verifier;
+
+// Schedules offset to be checked at depth, failing if it was seen at another
+static int visit(Verifier *v, size_t offset, int depth) {
+    if (offset > v->n || !v->boundary[offset]) return 0;
+    if (v->depth[offset] == UNKNOWN) {
+        v->depth[offset] = depth;
+        v->work[v->num_work++] = offset;
+        return 1;
+    }
+    return v->depth[offset] == depth;
+}
+
+// Converts an address operand into an offset, n being out of range
+static size_t to_offset(const Verifier *v, uint32_t addr) {
+    if (addr < v->start || addr - v->start > v->n) return v->n + 1;
+    return addr - v->start;
+}
+
+/* Walks the frame entered at entry with depth values in it. Entries of the
+ * lambdas it constructs are added to entries. Returns the deepest it gets,
+ * or -1 if it fails to verify.
+ */
+static int verify_frame(Verifier *v,
+        size_t entry,
+        int depth,
+        size_t *entries,
+        int *entry_depths,
+        size_t *num_entries) {
+    int max = depth;
+    if (!visit(v, entry, depth)) return -1;
+    while (v->num_work) {
+        size_t at = v->work[--v->num_work];
+        if (at == v->n) continue; // Runs into the HALT ending the code
+        int d = v->depth[at];
+        const uint8_t *pc = v->code->bytes + v->start + at;
+        Opcode op = *pc;
+        uint32_t operands[MAX_OPERANDS] = { 0 };
+        size_t next = at + decode(pc, operands);
+
+        int pops, pushes;
+        if (!stack_effect(op, operands, &pops, &pushes)) return -1;
+        if (pops > d) return -1;
+        if (op >= ADD_R && op <= NE_R) {
+            int reach = temps_depth(operands, d);
+            if (reach > max) max = reach;
+        }
+        d += pushes - pops;
+        if (d > max) max = d;
+
+        switch (op) {
+        case HALT:
+        case RET:
+        case TAIL_CALL:
+            break;
+        case JMP:
+            if (!visit(v, to_offset(v, operands[0]), d)) return -1;
+            break;
+        case JE:
+        case JNE:
+            if (!visit(v, to_offset(v, operands[0]), d)) return -1;
+            if (!visit(v, next, d)) return -1;
+            break;
+        case CONS_LAMBDA: {
+            size_t body = to_offset(v, operands[1]);
+            if (body >= v->n) return -1;
+            int found = 0;
+            for (size_t i = 0; i < *num_entries; i++) {
+                if (entries[i] == body) found = 1;
+            }
+            if (!found) {
+                entries[*num_entries] = body;
+                entry_depths[(*num_entries)++] = operands[2];
+            }
+            if (!visit(v, next, d)) return -1;
+            break;
+        }
+        default:
+            if (!visit(v, next, d)) return -1;
+            break;
+        }
+    }
+    return max;
+}
+
+int verify_code(Code *code, size_t start) {
+    if (code->verified != start) return 0;
+    Verifier v;
+    v.code = code;
+    v.start = start;
+    v.n = code->length - start;
+    v.depth = malloc((v.n + 1) * sizeof(int));
+    v.boundary = calloc(v.n + 1, sizeof(char));
+    v.work = malloc((v.n + 1) * sizeof(size_t));
+    v.num_work = 0;
+    for (size_t i = 0; i <= v.n; i++) v.depth[i] = UNKNOWN;
+
+    // Frames to check, starting with the top level code itself
+    size_t *entries = malloc((v.n + 1) * sizeof(size_t));
+    int *entry_depths = malloc((v.n + 1) * sizeof(int));
+    int *max_depths = malloc((v.n + 1) * sizeof(int));
+    size_t num_entries = 1;
+    entries[0] = 0;
+    entry_depths[0] = 0;
+
+    int ok = 1;
+    size_t at = 0;
+    while (at < v.n) {
+        uint32_t operands[MAX_OPERANDS];
+        v.boundary[at] = 1;
+        at += decode(code->bytes + start + at, operands);
+    }
+    if (at != v.n) ok = 0;
+    v.boundary[v.n] = 1;
+
+    for (size_t i = 0; ok && i < num_entries; i++) {
+        max_depths[i] = verify_frame(&v,
+            entries[i],
+            entry_depths[i],
+            entries,
+            entry_depths,
+            &num_entries);
+        if (max_depths[i] < 0) ok = 0;
+    }
+
+    if (ok) {
+        for (size_t i = 0; i < num_entries; i++) {
+            add_frame_depth(code, start + entries[i], max_depths[i]);
+        }
+        code->verified = code->length;
+    }
+    free(v.depth);
+    free(v.boundary);
+    free(v.work);
+    free(entries);
+    free(entry_depths);
+    free(max_depths);
+    return ok;
+}